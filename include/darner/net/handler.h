@@ -5,6 +5,7 @@
 #include <string>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
@@ -25,8 +26,12 @@ public:
    typedef boost::asio::ip::tcp::socket socket_type;
    typedef boost::shared_ptr<handler> ptr_type;
 
+   /*
+    * a connection may hold up to max_open_items items open at once.  a close or abort finishes all of them.  each set
+    * streams in chunks of its queue's chunk size, which must be at most max_chunk_size
+    */
    handler(boost::asio::io_service& ios, request_parser& parser, queue_map& queues, stats& _stats,
-      queue::size_type chunk_size = 1024);
+      queue::size_type max_chunk_size = 1024, size_t max_open_items = 1);
 
    ~handler();
 
@@ -66,6 +71,8 @@ private:
 
    void set_on_read_chunk(const boost::system::error_code& e, size_t bytes_transferred);
 
+   void set_on_commit(const boost::system::error_code& e);
+
    // get loop:
 
    void get_on_queue_return(const boost::system::error_code& e);
@@ -74,6 +81,8 @@ private:
 
    void get_on_write_chunk(const boost::system::error_code& e, size_t bytes_transferred);
 
+   void get_on_send_blob(const boost::system::error_code& e, size_t bytes_transferred);
+
    void get_on_pop_close_post(const boost::system::error_code& e);
 
    // utils
@@ -113,7 +122,8 @@ private:
 
    void hang_up(const boost::system::error_code& e, size_t bytes_transferred) {}
 
-   const queue::size_type chunk_size_;
+   const size_t max_open_items_;
+   queue::size_type chunk_size_; // of the item being set
 
    socket_type socket_;
    request_parser& parser_;
@@ -125,6 +135,7 @@ private:
    request req_;
 
    iqstream pop_stream_;
+   boost::ptr_vector<iqstream> open_streams_; // opened items set aside so pop_stream_ can open another
    oqstream push_stream_;
 };
 
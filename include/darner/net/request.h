@@ -30,6 +30,7 @@ struct request
    bool get_close;
    bool get_abort;
    bool set_sync;
+   size_t set_expiration; // as memcache has it: 0 for never, up to 30 days in seconds from now, or else a unix time
    size_t wait_ms;
 };
 
@@ -1,6 +1,8 @@
 #ifndef __DARNER_SERVER_HPP__
 #define __DARNER_SERVER_HPP__
 
+#include <algorithm>
+
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
@@ -22,10 +24,24 @@ class server
 public:
 
    server(const std::string& data_path,
-          unsigned short listen_port)
+          unsigned short listen_port,
+          const queue::options& queue_defaults = queue::options(),
+          const queue_map::options_map& queue_overrides = queue_map::options_map(),
+          size_t max_open_items = 1,
+          size_t compactions = 1,
+          queue::size_type compaction_rate = 0,
+          queue::size_type reap_rate = 0,
+          queue::size_type block_cache_size = 0,
+          size_t max_open_queues = 0,
+          queue::size_type queue_idle_ms = 0,
+          size_t recovery_threads = 1,
+          queue::size_type warm_rate = 0)
    : listen_port_(listen_port),
+     max_open_items_(max_open_items),
+     max_chunk_size_(max_chunk_size(queue_defaults, queue_overrides)),
      acceptor_(ios_),
-     queues_(ios_, data_path)
+     queues_(ios_, data_path, queue_defaults, queue_overrides, compactions, compaction_rate, reap_rate,
+        block_cache_size, max_open_queues, queue_idle_ms, recovery_threads, warm_rate)
    {
       // open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
       boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), listen_port_);
@@ -35,7 +51,7 @@ public:
       acceptor_.listen();
 
       // get our first conn ready
-      handler_ = handler::ptr_type(new handler(ios_, parser_, queues_, stats_));
+      handler_ = handler::ptr_type(new handler(ios_, parser_, queues_, stats_, max_chunk_size_, max_open_items_));
 
       // pump the first async accept into the loop
       acceptor_.async_accept(handler_->socket(),
@@ -55,6 +71,15 @@ public:
 
 private:
 
+   // the biggest chunk any queue streams items in, which every handler has to have room for
+   static queue::size_type max_chunk_size(const queue::options& defaults, const queue_map::options_map& overrides)
+   {
+      queue::size_type result = std::max(defaults.chunk_size, defaults.max_chunk_size);
+      for (queue_map::options_map::const_iterator it = overrides.begin(); it != overrides.end(); ++it)
+         result = std::max(result, std::max(it->second.chunk_size, it->second.max_chunk_size));
+      return result;
+   }
+
    void handle_accept(const boost::system::error_code& e)
    {
       if (e)
@@ -62,12 +87,14 @@ private:
 
       handler_->start();
 
-      handler_ = handler::ptr_type(new handler(ios_, parser_, queues_, stats_));
+      handler_ = handler::ptr_type(new handler(ios_, parser_, queues_, stats_, max_chunk_size_, max_open_items_));
       acceptor_.async_accept(handler_->socket(),
          boost::bind(&server::handle_accept, this, boost::asio::placeholders::error));
    }
 
    unsigned short listen_port_;
+   size_t max_open_items_;
+   queue::size_type max_chunk_size_;
 
    boost::asio::io_service ios_;
 
@@ -0,0 +1,86 @@
+#ifndef __DARNER_QUEUE_BLOB_STORE_H__
+#define __DARNER_QUEUE_BLOB_STORE_H__
+
+#include <map>
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+namespace darner {
+
+/*
+ * blob_store keeps the bodies of large items out of the journal, so they're written once and never copied by a
+ * compaction.  bodies are appended to blob files in the queue's directory, and the journal only holds a small header
+ * that says where a body is.
+ *
+ * a blob file is named for the first chunk id reserved while it was being appended to, and rolls to a new file after
+ * file_size bytes.  so every body in a file belongs to a chunk id below the next file's name, and once the queue's
+ * chunk low-water mark passes that, the whole file is unlinked.
+ *
+ * space is reserved for a body up front, so bodies being streamed in by different connections never interleave.
+ *
+ * blob_store is not thread-safe.
+ */
+class blob_store
+{
+public:
+
+   typedef boost::uint64_t id_type;
+   typedef boost::uint64_t size_type;
+
+   // opens the blob files already in the directory at path
+   blob_store(const std::string& path, size_type file_size);
+
+   ~blob_store();
+
+   // reserves size bytes for the body of an item whose chunks start at chunk.  returns where they go
+   void reserve(id_type chunk, size_type size, id_type& file, size_type& offset);
+
+   // writes part of a body
+   void write(id_type file, size_type offset, const std::string& data);
+
+   // reads size bytes of a body
+   void read(std::string& result, id_type file, size_type offset, size_type size);
+
+   // drops a body from the page cache, once it's been read for the last time
+   void drop(id_type file, size_type offset, size_type size);
+
+   // fdatasyncs a blob file
+   void sync(id_type file);
+
+   // the descriptor of a blob file, for sending a body straight from it.  it's valid until the file is released
+   int fd(id_type file) const;
+
+   // unlinks every file whose bodies all belong to chunks below chunks_low_water
+   void release(id_type chunks_low_water);
+
+   // how many blob files there are, and how many bytes they hold
+   size_type files() const { return files_.size(); }
+   size_type bytes() const { return bytes_; }
+
+private:
+
+   struct blob_file
+   {
+      blob_file(int _fd, size_type _size) : fd(_fd), size(_size) {}
+
+      int fd;
+      size_type size;
+   };
+
+   typedef std::map<id_type, blob_file> file_map;
+
+   std::string file_path(id_type file) const;
+
+   const blob_file& find(id_type file) const;
+
+   file_map files_; // by the first chunk id reserved in them.  the last one is appended to
+   size_type bytes_;
+
+   std::string path_;
+   size_type file_size_;
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_BLOB_STORE_H__
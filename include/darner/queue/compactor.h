@@ -0,0 +1,95 @@
+#ifndef __DARNER_QUEUE_COMPACTOR_H__
+#define __DARNER_QUEUE_COMPACTOR_H__
+
+#include <map>
+#include <sstream>
+#include <functional>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace darner {
+
+/*
+ * compactor schedules journal compactions for every queue in the server, on its own threads, so a compaction that
+ * takes seconds doesn't stall the event loop and a burst of them doesn't saturate the disk:
+ *
+ * - at most max_running compactions run at once
+ * - pending compactions run in order of debt, the bytes a queue popped since it last compacted
+ * - with a rate, compactions are spaced out so that on average they read and write no more than rate bytes per second.
+ *   a compaction is charged for what it did once it's done, and the next one waits until that's paid off
+ *
+ * queues post a job that compacts and returns how many bytes it reclaimed, and how many it read and wrote doing it.
+ * all methods are thread-safe.  the compactor must outlive every queue that posts to it.
+ */
+class compactor
+{
+public:
+
+   typedef boost::uint64_t size_type;
+   typedef boost::uint64_t ticket_type;
+   typedef boost::function<void ()> done_type;
+
+   // what a job did
+   struct result_type
+   {
+      result_type(size_type _reclaimed = 0, size_type _io = 0) : reclaimed(_reclaimed), io(_io) {}
+
+      size_type reclaimed; // bytes the journal shrank by
+      size_type io;        // bytes read and written
+   };
+
+   typedef boost::function<result_type ()> job_type;
+
+   // rate is in bytes read and written per second, 0 for no limit
+   compactor(size_t max_running = 1, size_type rate = 0);
+
+   // finishes any jobs already posted, then stops the threads
+   ~compactor();
+
+   // schedules job, then done once it's run and the stats are updated.  returns a ticket for cancel()
+   ticket_type post(size_type debt, const job_type& job, const done_type& done);
+
+   // drops a job that hasn't started yet, without calling done.  returns false if it's already running or done
+   bool cancel(ticket_type ticket);
+
+   // writes out compaction stats
+   void write_stats(std::ostringstream& out) const;
+
+private:
+
+   struct pending
+   {
+      ticket_type ticket;
+      job_type job;
+      done_type done;
+   };
+
+   // by most debt first.  equal debts keep the order they were posted in
+   typedef std::multimap<size_type, pending, std::greater<size_type> > pending_map;
+
+   void work();
+
+   size_type rate_;
+   boost::posix_time::ptime next_start_; // when rate allows the next compaction to start, given what the last ones did
+   bool stopping_;
+   ticket_type next_ticket_;
+   pending_map pending_;
+
+   mutable boost::mutex mutex_;
+   boost::condition_variable changed_;
+   boost::thread_group workers_;
+
+   size_type running_;
+   size_type compactions_; // finished
+   size_type total_ms_;
+   size_type last_ms_;
+   size_type bytes_reclaimed_;
+   size_type bytes_io_;
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_COMPACTOR_H__
@@ -11,13 +11,15 @@ class iqstream
 {
 public:
 
+   iqstream() : id_(0), chunk_pos_(0), tell_(0) {}
+
    /*
     * destroying an open iqstream will close it with erase = false
     */
    ~iqstream();
 
    /*
-    * tries to open an item for reading.  returns true if an item was available.
+    * tries to open an item for reading.  returns true if an item was available.  expired items are erased on the way
     */
    bool open(boost::shared_ptr<queue> queue);
 
@@ -27,6 +29,17 @@ public:
     */
    void read(std::string& result);
 
+   /*
+    * if the item is in a blob store, returns true with the file it's in and the offset of the next byte to read, so
+    * the rest can be sent straight from the file.  only valid after first read()
+    */
+   bool blob(int& fd, queue::size_type& offset) const;
+
+   /*
+    * moves past bytes of a blob item that were sent straight from its file
+    */
+   void skip(queue::size_type bytes);
+
    /*
     * closes the iqstream.  if erase, completes the pop of the item off the queue, otherwise returns it.
     */
@@ -38,7 +51,7 @@ public:
    queue::size_type tell() const { return tell_; }
 
    /*
-    * returns the size of the item.  only valid after first read()
+    * returns the size of the item
     */
    queue::size_type size() const { return header_.size; }
 
@@ -46,13 +59,22 @@ public:
     * returns true if open
     */
    operator bool() const { return queue_; }
+
+   /*
+    * trades items with another iqstream, open or not
+    */
+   void swap(iqstream& other);
    
 private:
 
+   // a blob item is read in as many even pieces as it was written in chunks
+   queue::size_type piece() const;
+
    boost::shared_ptr<queue> queue_;
 
    queue::id_type id_; // id of key in queue, only valid if open() succeeded
    queue::header_type header_; // only valid if it's multi-chunk
+   std::string item_; // a single-chunk item, from when it was opened until it's read
    queue::size_type chunk_pos_;
    queue::size_type tell_;
 };
@@ -0,0 +1,127 @@
+#ifndef __DARNER_QUEUE_MEMORY_JOURNAL_H__
+#define __DARNER_QUEUE_MEMORY_JOURNAL_H__
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <stdint.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <leveldb/db.h>
+#include <leveldb/options.h>
+#include <leveldb/comparator.h>
+#include <leveldb/write_batch.h>
+
+namespace darner {
+
+/*
+ * memory_journal keeps a queue's keys in memory, for queues whose items aren't worth a write to disk.  nothing
+ * survives the journal being closed.
+ *
+ * the journal holds about limit bytes of keys and values.  past that it's full, and what happens next is up to how
+ * it was opened:
+ *
+ * - without spill options it takes the write anyway, and leaves it to the queue to turn away pushes while full()
+ * - with spill options it moves everything into a leveldb journal in a spill directory, and from then on works like
+ *   that journal, until the queue drains and unspill() brings what's left back into memory
+ *
+ * the spill directory is scratch space: it's wiped when the journal is opened and when it's unspilled.
+ *
+ * memory_journal implements just enough of leveldb::DB for queue to use it in place of leveldb: snapshots are not
+ * supported, and iterators see writes made after they were created, except while spilled.  it is thread-safe.
+ */
+class memory_journal : public leveldb::DB
+{
+public:
+
+   typedef boost::uint64_t size_type;
+
+   /*
+    * opens an empty memory journal.  keys are ordered by cmp, which must outlive the journal.  with spill_options, it
+    * spills to a leveldb journal at spill_path once it holds over limit bytes
+    */
+   memory_journal(const leveldb::Comparator* cmp, size_type limit, const std::string& spill_path,
+      const leveldb::Options* spill_options = NULL);
+
+   ~memory_journal();
+
+   leveldb::Status Put(const leveldb::WriteOptions& options, const leveldb::Slice& key, const leveldb::Slice& value);
+
+   leveldb::Status Delete(const leveldb::WriteOptions& options, const leveldb::Slice& key);
+
+   leveldb::Status Write(const leveldb::WriteOptions& options, leveldb::WriteBatch* updates);
+
+   leveldb::Status Get(const leveldb::ReadOptions& options, const leveldb::Slice& key, std::string* value);
+
+   leveldb::Iterator* NewIterator(const leveldb::ReadOptions& options);
+
+   const leveldb::Snapshot* GetSnapshot() { return NULL; }
+
+   void ReleaseSnapshot(const leveldb::Snapshot* snapshot) {}
+
+   // passed on to the spill journal, if there is one
+   bool GetProperty(const leveldb::Slice& property, std::string* value);
+
+   void GetApproximateSizes(const leveldb::Range* range, int n, uint64_t* sizes);
+
+   // compacts the spill journal, if there is one.  it can take a while, so it mustn't overlap unspill().  deleted keys
+   // are freed right away in memory
+   void CompactRange(const leveldb::Slice* begin, const leveldb::Slice* end);
+
+   // returns true if size more bytes would take it over its limit, and it can't spill
+   bool full(size_type size = 0) const;
+
+   // bytes of keys and values held in memory
+   size_type bytes() const;
+
+   // returns true if it's spilled to disk
+   bool spilled() const;
+
+   /*
+    * brings the spill journal back into memory, if what's left in it fits.  this copies every key that's left, so
+    * it's meant for when the queue is empty.  returns false if it's still spilled
+    */
+   bool unspill();
+
+private:
+
+   class iterator;
+   class applier;
+
+   class key_less
+   {
+   public:
+      key_less(const leveldb::Comparator* cmp) : cmp_(cmp) {}
+      bool operator()(const std::string& a, const std::string& b) const { return cmp_->Compare(a, b) < 0; }
+   private:
+      const leveldb::Comparator* cmp_;
+   };
+
+   typedef std::map<std::string, std::string, key_less> items_type;
+
+   // moves everything into the spill journal, or logs why it can't and stays in memory.  called with mutex_ held
+   void spill();
+
+   // closes the spill journal and wipes it.  called with mutex_ held
+   void close_spill();
+
+   const leveldb::Comparator* cmp_;
+   size_type limit_;
+   std::string spill_path_;
+   bool can_spill_;
+   leveldb::Options spill_options_;
+
+   mutable boost::mutex mutex_;
+   items_type items_;
+   size_type bytes_;
+   boost::scoped_ptr<leveldb::DB> spill_; // while spilled, everything is here instead of in items_
+   std::set<iterator*> iterators_;        // so they can let go of the spill journal before it's closed
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_MEMORY_JOURNAL_H__
@@ -18,14 +18,19 @@ public:
 
    /*
     * immediately opens an oqstream for writing.  the stream will automatically close after chunks_count chunks
-    * have been written
+    * have been written.  given the item's size, a multi-chunk item over the queue's blob_threshold goes to its blob
+    * store, and an item that doesn't fit in a full memory queue is read in and dropped, as is one that a queue at its
+    * limits rejects.  either is answered with no_buffer_space.  expiration is as memcache's set has it, see
+    * queue::expires
     */
-   void open(boost::shared_ptr<queue> queue, queue::size_type chunks_count, bool sync = false);
+   void open(boost::shared_ptr<queue> queue, queue::size_type chunks_count, bool sync = false,
+      queue::size_type size = 0, queue::size_type expiration = 0);
 
    /*
-    * writes a chunk of the item. fails if more chunks are written than originally reserved.
+    * writes a chunk of the item. fails if more chunks are written than originally reserved.  if cb is provided with
+    * the final chunk, the item may be committed asynchronously, and cb is called once it's in the queue.
     */
-   void write(const std::string& chunk);
+   void write(const std::string& chunk, const queue::push_callback& cb = queue::push_callback());
 
    /*
     * cancels the oqstream write.  only available if the stream hasn't written chunks_count chunks yet
@@ -44,7 +49,10 @@ private:
    queue::id_type id_; // id of key in queue, only set after all chunks are written
    queue::header_type header_; // only set if it's multi-chunk
    queue::size_type chunk_pos_;
+   queue::size_type size_; // the item's size as given to open, so a blob item can't overrun what it reserved
    bool sync_;
+   bool dropping_; // the queue was full, so the item goes nowhere
+   bool rejecting_; // and the push is answered with an error
 };
 
 } // darner
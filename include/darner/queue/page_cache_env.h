@@ -0,0 +1,60 @@
+#ifndef __DARNER_QUEUE_PAGE_CACHE_ENV_H__
+#define __DARNER_QUEUE_PAGE_CACHE_ENV_H__
+
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+#include <leveldb/env.h>
+
+namespace darner {
+
+/*
+ * page_cache_env is a leveldb::Env that keeps what a queue is done with out of the page cache, so a deep queue doesn't
+ * crowd out everything else on the box:
+ *
+ * - write-ahead logs are only read back after a crash, so their pages are dropped as soon as they're synced, and
+ *   when they're retired
+ * - logs and manifests replayed at startup are read once, front to back, and dropped after
+ * - tables a compaction reads are read ahead sequentially, and dropped when the compaction deletes them
+ *
+ * live tables are left alone: a queue's tail, and whatever a warm-up read of it, stay in the page cache until they're
+ * compacted away.  tables are read with pread rather than mmap, so that the compaction's reads can be told apart.
+ * everything is a hint to the kernel, and a no-op where fadvise isn't supported.  it's thread-safe.
+ */
+class page_cache_env : public leveldb::EnvWrapper
+{
+public:
+
+   typedef boost::uint64_t size_type;
+
+   page_cache_env(leveldb::Env* target = leveldb::Env::Default());
+
+   leveldb::Status NewSequentialFile(const std::string& fname, leveldb::SequentialFile** result);
+
+   leveldb::Status NewRandomAccessFile(const std::string& fname, leveldb::RandomAccessFile** result);
+
+   leveldb::Status NewWritableFile(const std::string& fname, leveldb::WritableFile** result);
+
+   leveldb::Status DeleteFile(const std::string& fname);
+
+   // runs leveldb's compactions marked as such, so the tables they read can be told from a queue's
+   void Schedule(void (*function)(void* arg), void* arg);
+
+   // how many bytes of the files in the directory at path are in the page cache.  maps every file, so it's not cheap
+   static size_type resident_bytes(const std::string& path);
+
+private:
+
+   class sequential_file;
+   class table_file;
+   class log_file;
+
+   struct job;
+
+   static void run(void* arg);
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_PAGE_CACHE_ENV_H__
@@ -1,9 +1,11 @@
 #ifndef __DARNER_QUEUE_H__
 #define __DARNER_QUEUE_H__
 
-#include <set>
 #include <string>
+#include <vector>
+#include <set>
 #include <sstream>
+#include <utility>
 
 #include <boost/array.hpp>
 #include <boost/ptr_container/ptr_list.hpp>
@@ -12,9 +14,24 @@
 #include <boost/function.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/weak_ptr.hpp>
 
 #include <leveldb/db.h>
+#include <leveldb/cache.h>
 #include <leveldb/comparator.h>
+#include <leveldb/write_batch.h>
+
+#include "darner/queue/blob_store.h"
+#include "darner/queue/compactor.h"
+#include "darner/queue/memory_journal.h"
+#include "darner/queue/page_cache_env.h"
+#include "darner/queue/reaper.h"
+#include "darner/queue/warmer.h"
+#include "darner/util/fifo_cache.hpp"
+#include "darner/util/histogram.hpp"
+#include "darner/util/id_set.hpp"
 
 namespace darner {
 
@@ -23,7 +40,7 @@ namespace darner {
  *
  * - an evented wait semantic for queue poppers
  * - popping is two-phase with a begin and an end. ending a pop can either erase it or return it back to the queue.
- * - large items are streamed in a chunk at a time
+ * - large items are streamed in a chunk at a time, and items over blob_threshold are kept out of the journal
  *
  * all queue methods are synchronous except for wait(), which starts an async timer on the provided io_service.
  *
@@ -38,22 +55,150 @@ public:
    typedef boost::uint64_t id_type;
    typedef boost::uint64_t size_type;
    typedef boost::function<void (const boost::system::error_code& error)> wait_callback;
+   typedef boost::function<void (const boost::system::error_code& error)> push_callback;
+   typedef boost::function<boost::shared_ptr<queue> ()> target_type;
+
+   // tunables for a queue.  the server sets defaults for all queues, and a config file can override them per queue
+   struct options
+   {
+      enum journal_type
+      {
+         JT_LEVELDB = 1, // every item and chunk is a leveldb key
+         JT_SEGMENT = 2, // items and chunks are appended to segment files, see segment_journal
+         JT_MEMORY  = 3  // items and chunks are only kept in memory, see memory_journal
+      };
+
+      // besides /sync pushes, when do we fsync the journal?
+      enum sync_type
+      {
+         ST_NEVER        = 1, // leave it to the journal
+         ST_ALWAYS       = 2, // every push is synced
+         ST_MILLISECONDS = 3, // sync_every milliseconds after an unsynced write
+         ST_ITEMS        = 4  // every sync_every pushes
+      };
+
+      options();
+
+      // sets an option by name, as it appears in a config file.  returns false if the name or value is bad
+      bool set(const std::string& key, const std::string& value);
+
+      journal_type journal;     // only used when creating a journal, an existing journal keeps its type
+      size_type segment_size;   // segment journals roll to a new file after this many bytes
+      size_type memory_limit;   // memory journals hold this many bytes before they're full
+      bool memory_spill;        // a full memory journal spills to leveldb, or drops pushes.  set as "spill" or "drop"
+      size_type sync_window_ms; // how long to gather synced pushes into one fsync, 0 for one loop turn
+      sync_type sync_journal;   // set as "never", "always", "<N>ms", or "<N>items"
+      size_type sync_every;
+      size_type cache_size;     // bytes of newly pushed items to keep in memory for pops, 0 for none
+      size_type read_ahead;     // on a cache miss, how many of the following items or chunks to read into the cache
+      size_type compact_bytes;  // compact the journal after this many bytes of items are popped
+      size_type warm_bytes;     // when the journal's opened, read this many bytes from the tail into the cache
+      size_type chunk_size;     // bytes per chunk when streaming an item in
+      size_type max_chunk_size; // larger items stream in bigger chunks, up to this many bytes.  0 for just chunk_size
+      size_type blob_threshold; // items over this many bytes go to the blob store, 0 to keep every item in the journal
+      size_type blob_file_size; // blob files roll to a new file after this many bytes
+      size_type max_age_ms;     // items expire this long after they're pushed, unless they expire sooner.  0 for never
+      std::string expire_to;    // the queue expired items are moved to, or empty to just erase them
+      size_type sweep_ms;       // how often to sweep out items that have expired
+      size_type max_items;      // the most items the queue holds, 0 for no limit
+      size_type max_bytes;      // the most bytes of items the queue holds, 0 for no limit
+      bool discard_old;         // past a limit, discard the oldest items, or reject sets.  "discard_old" or "reject"
+
+      // leveldb journal tuning.  segment journals ignore these
+      size_type write_buffer_size; // bytes of writes leveldb holds in memory before writing a table
+      size_type block_size;        // bytes of items per table block, before compression
+      size_type max_open_files;    // table files leveldb keeps open
+      bool compression;            // snappy compress table blocks, set as "on" or "off"
+      bool drop_behind;            // drop compacted journal data and popped blobs from the page cache, "on" or "off"
+      leveldb::Cache* block_cache; // a block cache shared with other queues, or NULL for leveldb's.  not set by name
+   };
 
-   // open or create the queue at the path
-   queue(boost::asio::io_service& ios, const std::string& path);
+   // returns true if the journal at path was destroyed, and should be deleted rather than opened
+   static bool destroyed(const std::string& path);
+
+   // the file that marks the journal at path as destroyed
+   static std::string destroyed_path(const std::string& path);
+
+   // marks the journal at path as destroyed
+   static void mark_destroyed(const std::string& path);
+
+   /*
+    * returns true if path looks like a journal that an older darner renamed to <queue>.<N> to destroy, and didn't get
+    * to delete.  those aren't marked, so we go by what's left: no summary, still in the old key format, and the queue
+    * it was renamed from is there too
+    */
+   static bool abandoned(const std::string& path);
+
+   // returns true if path is scratch space left by a journal migration.  opening the queue it belongs to cleans it up
+   static bool migrating(const std::string& path);
+
+   // what a queue left behind when it was last closed, so it can be reported on without opening its journal
+   struct summary_type
+   {
+      summary_type() : items(0), bytes(0), pushed(0) {}
 
-   // destruct the queue, and delete the journal if destroy() was called
+      size_type items;
+      size_type bytes;
+      boost::uint64_t pushed; // when the oldest item was pushed, as header_type has it.  0 if it's empty or unstamped
+
+      // as queue::age_ms(), for a closed queue
+      size_type age_ms() const;
+   };
+
+   /*
+    * reads the summary a queue left at path when it was last closed, without opening its journal.  returns false if
+    * there's none, because the queue is open or didn't close cleanly
+    */
+   static bool summary(const std::string& path, summary_type& result);
+
+   /*
+    * open or create the queue at the path.  compactions go to comp if there is one, a destroyed journal goes to
+    * reap if there is one, and warming up the tail goes to warm if there is one.  otherwise they happen inline
+    */
+   queue(boost::asio::io_service& ios, const std::string& path, const options& opts = options(),
+      compactor* comp = NULL, reaper* reap = NULL, warmer* warm = NULL);
+
+   // destruct the queue, and delete the journal if destroy() was called.  waits out any compaction in progress
    ~queue();
 
    // wait up to wait_ms milliseconds for an item to become available, then call cb with success or timeout
    void wait(size_type wait_ms, const wait_callback& cb);
 
-   // delete the journal upon destruction
+   // delete the journal upon destruction.  until then, it's renamed out of the way and marked as destroyed
    void destroy();
 
+   /*
+    * drops every item in the queue in constant time: the tail jumps to the head, and a low-water mark is persisted so
+    * the dropped items stay dropped across restarts.  their keys are reclaimed in the background.  items that are open
+    * when the queue is flushed are dropped once they're closed, and pushes still in progress come through the flush
+    */
+   void flush();
+
    // returns the number of items in the queue
    size_type count() const;
 
+   // returns the bytes of items in the queue, counting open items but not their keys or chunking
+   size_type bytes() const { return bytes_; }
+
+   /*
+    * the chunk size to stream in an item of size bytes.  with a max_chunk_size, chunks double from chunk_size until
+    * the item is at most 16 chunks, so big items don't cost a key and a few syscalls per kilobyte
+    */
+   size_type chunk_size(size_type size) const;
+
+   // returns how long ago the oldest item in the queue was pushed, in milliseconds.  0 if it's empty, or if the item is
+   // from before items were stamped
+   size_type age_ms() const;
+
+   // returns when the oldest item in the queue was pushed, as header_type has it.  0 if it's empty or unstamped
+   boost::uint64_t oldest_pushed() const;
+
+   // where expired items go, if options.expire_to names a queue.  target is asked for it each time one expires
+   void expire_to(const target_type& target) { expire_to_ = target; }
+
+   // returns true if nothing is open, waiting to be written, or compacting, so the queue can be closed without a wait
+   bool idle() const;
+
    // writes out stats (stuff like queue count) to a stream
    void write_stats(const std::string& name, std::ostringstream& out) const;
 
@@ -62,37 +207,51 @@ protected:
    friend class iqstream;
    friend class oqstream;
 
-   // queue item points to chunk item via a small metadata header
+   /*
+    * queue item points to chunk item via a small metadata header.  a blob item reserves its chunks like any other
+    * multi-chunk item, but only the first is written, as a marker.  its bytes are at offset in the blob file.  pop_read
+    * also fills in when every item, single-chunk or not, was pushed, and when it expires
+    */
    class header_type
    {
    public:
 
-      header_type() : beg(0), end(1), size(0) {}
+      header_type() : beg(0), end(1), size(0), blob(false), file(0), offset(0), pushed(0), expires(0) {}
       header_type(id_type _beg, id_type _end, size_type _size)
-      : beg(_beg), end(_end), size(_size) {}
-      header_type(const std::string& buf)
-      {
-         *this = *reinterpret_cast<const header_type*>(buf.c_str());
-      }
+      : beg(_beg), end(_end), size(_size), blob(false), file(0), offset(0), pushed(0), expires(0) {}
+      header_type(const std::string& buf);
 
       id_type beg;
       id_type end;
       size_type size;
 
+      bool blob;
+      id_type file;
+      size_type offset;
+
+      boost::uint64_t pushed;  // microseconds since the epoch, or 0 for items pushed before items were stamped
+      boost::uint64_t expires; // microseconds since the epoch, or 0 for never
+
       void str(std::string& out) const;
    };
 
    // queue methods aren't meant to be used directly.  instead create an iqstream or oqstream to use it
 
    /*
-    * pushes an item to to the queue.
+    * pushes an item to to the queue.  without a callback, the push is written immediately.  with a callback, the push
+    * joins a group commit: every push in this turn of the event loop is written in one batch, and then each cb is
+    * called.  a synced push in a group makes the whole batch synced, or if there's a sync window, its cb waits for the
+    * single fsync at the end of the window.  the item isn't poppable until the batch is written.  an item that
+    * expires (see expires()) goes into the expiry index in the same write
     */
-   void push(id_type& result, const std::string& item, bool sync);
+   void push(id_type& result, const std::string& item, bool sync, boost::uint64_t expires,
+      const push_callback& cb = push_callback());
 
    /*
-    * pushes a header to to the queue.  a header points to a range of chunks in a multi-chunk item.
+    * pushes a header to to the queue.  a header points to a range of chunks in a multi-chunk item, and says when it
+    * expires
     */
-   void push(id_type& result, const header_type& header, bool sync);
+   void push(id_type& result, const header_type& header, bool sync, const push_callback& cb = push_callback());
 
    /*
     * begins popping an item.  if no items are available, immediately returns false.  once an item pop is begun,
@@ -112,9 +271,24 @@ protected:
     * closing an item with erase = false could take logn time and linear memory for # returned items.
     *
     * the simplest way to address this is to limit the number of items that can be opened at once.
+    *
+    * erases join the group commit: every erase in this turn of the event loop is written in the same batch as that
+    * turn's pushes.  the item is gone from the queue right away, but its delete hits the journal at the commit.
     */
    void pop_end(bool erase, id_type id, const header_type& header);
 
+   /*
+    * once an item's been read, call pop_expired.  if it's expired, it's erased, or moved to expire_to, and the pop is
+    * ended.  returns true if it was
+    */
+   bool pop_expired(id_type id, const header_type& header, const std::string& item);
+
+   /*
+    * when an item pushed now with a memcache expiration expires, or 0 for never.  expiration is 0 for never, up to
+    * 30 days of seconds from now, or else a unix time.  max_age_ms caps it
+    */
+   boost::uint64_t expires(size_type expiration) const;
+
    // chunk methods:
 
    /*
@@ -128,29 +302,84 @@ protected:
    void write_chunk(const std::string& chunk, id_type chunk_key);
 
    /*
-    * reads a chunk
+    * reads a chunk.  the chunks after it, up to chunk_end, may be read ahead
     */
-   void read_chunk(std::string& result, id_type chunk_key);
+   void read_chunk(std::string& result, id_type chunk_key, id_type chunk_end);
 
    /*
     * removes all chunks referred to by a header.  use this when aborting a multi-chunk push.
     */
    void erase_chunks(const header_type& header);
 
+   // blob methods:
+
+   // returns true if an item of size bytes goes to the blob store
+   bool use_blob(size_type size) const
+   {
+      return !memory_ && options_.blob_threshold && size > options_.blob_threshold;
+   }
+
+   /*
+    * like reserve_chunks, but also reserves size bytes in the blob store.  a blob header is erased like any other
+    */
+   void reserve_blob(header_type& result, size_type count, size_type size);
+
+   /*
+    * writes data at pos bytes into a blob item
+    */
+   void write_blob(const std::string& data, const header_type& header, size_type pos);
+
+   /*
+    * reads size bytes from pos bytes into a blob item
+    */
+   void read_blob(std::string& result, const header_type& header, size_type pos, size_type size);
+
+   /*
+    * the descriptor of the file a blob item is in.  it stays valid while the item is open
+    */
+   int blob_fd(const header_type& header) const;
+
+   // memory journal methods:
+
+   // returns true if the journal is in memory and full, so an item of size bytes should be dropped
+   bool full(size_type size) const { return memory_ && memory_->full(size); }
+
+   // counts a push that was dropped because the queue was full, and answers it with no_buffer_space, as reject does
+   void drop(const push_callback& cb);
+
+   // limit methods:
+
+   // returns true if an item of size bytes would take the queue past max_items or max_bytes, and it rejects sets
+   bool rejects(size_type size) const;
+
+   /*
+    * counts a push that was rejected because the queue was at its limit, and answers it with no_buffer_space.  without
+    * a callback, it throws that
+    */
+   void reject(const push_callback& cb);
+
 private:
 
+   /*
+    * keys are a type byte followed by a big-endian id, so they sort with memcmp and the journal can use leveldb's
+    * bytewise comparator.  journals from before this format had a native-endian id followed by the type byte, and
+    * are migrated when they're opened.  expiry index keys are longer, see expiry_key
+    */
    class key_type
    {
    public:
 
-      enum  { KT_QUEUE = 1, KT_CHUNK = 2 }; // a key can be either a queue or a chunk type
+      // a key can be a queue or a chunk type, queue metadata, or in the expiry index
+      enum  { KT_META = 0, KT_QUEUE = 1, KT_CHUNK = 2, KT_EXPIRY = 3 };
 
       key_type() : type(KT_QUEUE), id(0) {}
 
       key_type(char _type, id_type _id) : type(_type), id(_id) {}
 
-      key_type(const leveldb::Slice& s)
-      : type(s.data()[sizeof(id_type)]), id(*reinterpret_cast<const id_type*>(s.data())) {}
+      key_type(const leveldb::Slice& s);
+
+      // decodes a key in the old format
+      static key_type legacy(const leveldb::Slice& s);
 
       leveldb::Slice slice() const;
 
@@ -167,6 +396,8 @@ private:
          return 0;
       }
 
+      bool operator<(const key_type& other) const { return compare(other) < 0; }
+
       unsigned char type;
       id_type id;
 
@@ -188,27 +419,142 @@ private:
       boost::asio::deadline_timer timer;
    };
 
-   // compare keys as native uint64's instead of lexically
-   class comparator : public leveldb::Comparator
+   // orders keys in the old format, so we can read an old journal to migrate it
+   class legacy_comparator : public leveldb::Comparator
    {
    public:
       int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
       {
-         return key_type(a).compare(key_type(b));
+         return key_type::legacy(a).compare(key_type::legacy(b));
       }
       const char* Name() const { return "queue::comparator"; }
       void FindShortestSeparator(std::string*, const leveldb::Slice&) const {}
       void FindShortSuccessor(std::string*) const {}
    };
 
+   // pushes an encoded item or header of size bytes, and its expiry index key if it expires
+   void push_value(id_type& result, const std::string& value, size_type size, boost::uint64_t expires, bool sync,
+      const push_callback& cb);
+
+   // erases an item that's popped or expired, along with its chunks and its expiry index key
+   void erase(id_type id, const header_type& header);
+
+   // counts an open item closed.  if it was open at the last flush, the chunk mark moves once they all are
+   void close(id_type id, const header_type& header);
+
+   // erases an expired item, moving it to expire_to first if there's a queue there
+   void expire(id_type id, const header_type& header, const std::string& item);
+
+   /*
+    * the expiry index has a key for every item that expires: KT_EXPIRY, then when it expires and its id, both
+    * big-endian, so the index is in order of expiry and the sweep only reads what's due.  its values are empty
+    */
+   static std::string expiry_key(boost::uint64_t expires, id_type id);
+   static void expiry_key(const leveldb::Slice& key, boost::uint64_t& expires, id_type& id);
+
+   // makes sure a sweep is coming in sweep_ms
+   void arm_sweep();
+
+   // like the scheduled commit, the sweep timer doesn't keep the queue alive
+   static void sweep_timeout(const boost::weak_ptr<queue>& self, const boost::system::error_code& e);
+
+   // expires a batch of the items that are due, walking the expiry index from the front
+   void sweep();
+
+   // with discard_old, erases the oldest items until the queue's back within its limits
+   void discard();
+
+   // makes sure a commit is coming at the end of this turn of the event loop
+   void schedule_commit();
+
+   // the scheduled commit doesn't keep the queue alive.  if the queue is gone first, its dtor wrote the group
+   static void scheduled_commit(const boost::weak_ptr<queue>& self);
+
+   // writes out the pending group commit, then calls back everyone in it
+   void commit();
+
+   // fires when the sync window closes: fsync, then call back the synced pushes that were waiting on it
+   void sync_window_timeout(const boost::system::error_code& e);
+
+   // true if the sync_journal policy wants the next push synced
+   bool sync_due() const;
+
+   // fsyncs the journal
+   void sync_journal();
+
+   // fires sync_every milliseconds after an unsynced write
+   void sync_timeout(const boost::system::error_code& e);
+
+   // tracks writes for the sync_journal policy
+   void wrote(bool synced);
+
    // any operation that adds to the queue should crank a wakeup
    void wake_up();
 
    // fires either if timer times out or is canceled
    void waiter_wakeup(const boost::system::error_code& e, boost::ptr_list<waiter>::iterator waiter_it);
 
-   // compact the underlying journal, discarding deleted items
-   void compact();
+   // reads key from the journal with cursor_, and caches up to options_.read_ahead of the keys after it, short of end
+   void read_ahead(const key_type& key, id_type end, std::string& result);
+
+   // opens the journal at path_, using whichever journal type is already there.  an old format journal is migrated
+   void open_journal(bool create_if_missing);
+
+   // opens a leveldb or segment journal, as segmented_ says, at path, with keys ordered by cmp
+   leveldb::Status open_journal(const std::string& path, const leveldb::Comparator* cmp, bool create_if_missing,
+      leveldb::DB** result);
+
+   // appends the time, and when it expires if it does, to a value that's about to be pushed
+   static void stamp(std::string& value, boost::uint64_t expires);
+
+   // strips the stamp and escapes off a value that was pushed, and decodes it if it's a header
+   static void decode(std::string& value, header_type& header);
+
+   // the leveldb options for a journal, from options_
+   leveldb::Options leveldb_options(const leveldb::Comparator* cmp, bool create_if_missing) const;
+
+   // brings a spilled memory journal back into memory, once the queue's drained
+   void unspill();
+
+   // copies every key in legacy to a new journal in the current format, then swaps it in for the journal at path_
+   void migrate(boost::scoped_ptr<leveldb::DB>& legacy);
+
+   // erases chunks [beg, end), adding deletes to batch for any that the chunk low-water mark doesn't cover
+   void erase_chunk_range(leveldb::WriteBatch& batch, id_type beg, id_type end);
+
+   // moves mark up past every id in erased that it now touches
+   static bool advance(id_set& erased, id_type& mark);
+
+   // the low-water marks and the byte count as they're persisted in the metadata key, with pushing bytes about to be
+   // written along with it
+   std::string marks(size_type pushing = 0) const;
+
+   // adds up the bytes of the items in the queue, for journals from before the byte count was persisted
+   size_type count_bytes();
+
+   // unlinks blob files whose items are all below the chunk low-water mark
+   void release_blobs();
+
+   // compact the underlying journal, discarding deleted items.  debt is the bytes of items erased since the last call
+   void compact(size_type debt);
+
+   // reclaims everything below the low-water marks, then compacts it.  runs on the compactor thread if there is one
+   compactor::result_type compact_journal();
+
+   // deletes every key of type in [from, to), then compacts that range
+   compactor::result_type reclaim(unsigned char type, id_type from, id_type to);
+
+   // called on the compactor thread once it's done with the journal
+   void compaction_done();
+
+   // blocks until no compaction is running on the journal
+   void wait_for_compaction();
+
+   // reads the next bit of the tail into the cache, returning how many bytes it read, or 0 once it's warm
+   size_type warm_step();
+
+   // cancels the warm-up, if it's not done yet
+   void stop_warming();
 
    // some leveldb sugar:
 
@@ -218,6 +564,7 @@ private:
       write_options.sync = sync;
       if (!journal_->Put(write_options, key.slice(), value).ok())
          throw boost::system::system_error(boost::system::errc::io_error, boost::asio::error::get_system_category());
+      wrote(sync);
    }
 
    void get(const key_type& key, std::string& result)
@@ -226,32 +573,131 @@ private:
          throw boost::system::system_error(boost::system::errc::io_error, boost::asio::error::get_system_category());
    }
 
-   void write(leveldb::WriteBatch& batch)
+   void write(leveldb::WriteBatch& batch, bool sync = false)
    {
-      if (!journal_->Write(leveldb::WriteOptions(), &batch).ok())
+      leveldb::WriteOptions write_options;
+      write_options.sync = sync;
+      if (!journal_->Write(write_options, &batch).ok())
          throw boost::system::system_error(boost::system::errc::io_error, boost::asio::error::get_system_category());
+      wrote(sync);
    }
 
-   boost::scoped_ptr<comparator> cmp_;
+   boost::scoped_ptr<page_cache_env> env_; // only with drop_behind.  the journal uses it, so it goes after
+   // with drop_behind, how much of the queue is in the page cache, as the reaper last counted it
+   boost::shared_ptr<const reaper::page_cache_count> page_cache_;
    boost::scoped_ptr<leveldb::DB> journal_;
+   memory_journal* memory_; // journal_, if it's a memory journal.  like segment journals, they always delete
+   boost::scoped_ptr<blob_store> blobs_;
+
+   // a long-lived iterator for reading ahead.  it's left just past what it read ahead, so the next miss is usually
+   // right where it is.  a leveldb iterator pins the journal as it was, so we drop it on compaction
+   boost::scoped_ptr<leveldb::Iterator> cursor_;
 
-   // journal has queue keys and chunk keys
+   // journal has queue keys and chunk keys, and a metadata key that holds the low-water marks and the byte count
    // layout of queue keys in journal is:
-   // --- < opened/returned > --- | TAIL | --- < enqueued > --- | HEAD |
+   // --- < erased > --- | LOW WATER | --- < opened/returned/erased > --- | TAIL | --- < enqueued > --- | HEAD |
    // enqueued items are pushed to head and popped from tail
    // opened are held by a handler (via the key) and not finished yet
    // returned items were released by a connection but not deleted, and behave like enqueued items
+   // erased items below LOW WATER have no tombstones, the persisted mark is what says they're gone
    // layout of chunk store in journal is:
-   // --- < stored > --- | HEAD |
+   // --- < erased > --- | LOW WATER | --- < stored > --- | HEAD |
 
    key_type queue_head_;
    key_type queue_tail_;
    key_type chunks_head_;
 
    size_type items_open_; // an open item is < TAIL but not in returned_
-   size_type bytes_evicted_; // after we've evicted 32MB from the journal, compress that evicted range
+   size_type bytes_evicted_; // after we've evicted compact_bytes from the journal, compress that evicted range
 
-   std::set<id_type> returned_; // items < TAIL that were reserved but later returned (not popped)
+   compactor* compactor_;
+   reaper* reaper_;
+   mutable boost::mutex compact_mutex_;
+   boost::condition_variable compacted_;
+   bool compacting_; // a compaction is scheduled or running on the compactor, and using journal_
+   compactor::ticket_type compact_ticket_;
+   size_type compact_debt_; // bytes erased since a compaction was last posted, so a follow-up is posted with its debt
+
+   /*
+    * every queue key below low_water_ and chunk key below chunks_low_water_ is erased.  erases usually come in order,
+    * so the marks just move up and the erases cost no tombstones.  an erase that lands above a mark waits in
+    * erased_ or chunks_erased_ (with a tombstone, in case we restart first) until the mark catches up to it.  a flush
+    * moves the queue mark to HEAD, and the chunk mark follows once the items open at the flush are closed
+    */
+   id_type low_water_;
+   id_type chunks_low_water_;
+   id_set erased_;
+   id_set chunks_erased_;
+   bool marks_dirty_; // the marks moved since they were last written
+   bool segmented_; // segment journals free space by deletes and have no tombstones to scan, so they always delete
+   std::multiset<id_type> reserved_; // the first chunk of each reservation that's still being written
+   size_type flush_open_; // items open at the last flush that are still open
+   size_type flush_bytes_; // and their bytes, which don't come back after a restart
+   id_type flush_chunks_; // where the chunk mark goes once they're closed
+
+   size_type open_ms_; // how long it took to open the journal and find the head and tail
+   size_type dropped_; // pushes dropped because the memory journal was full
+   size_type expired_items_; // items erased or moved because they expired
+   size_type discarded_; // items erased to make room under the limits
+   size_type rejected_;  // pushes rejected because the queue was at its limits
+
+   // bytes of the items in the queue, persisted with the marks, and bytes of the items that are open
+   size_type bytes_;
+   size_type open_bytes_;
+
+   histogram time_in_queue_; // milliseconds from push to erase, of every item erased since the queue was opened
+   mutable id_type age_id_;  // the oldest item the last time oldest_pushed() looked, and when it was pushed
+   mutable boost::uint64_t age_pushed_;
+
+   // how far compaction has reclaimed each keyspace, and how far it should go next.  guarded by compact_mutex_
+   id_type queue_reclaimed_;
+   id_type chunks_reclaimed_;
+   id_type queue_reclaim_to_;
+   id_type chunks_reclaim_to_;
+
+   // the warm-up reads from where TAIL was at open, through the queue keys and the chunks they point to.  once it's
+   // posted, warm_it_ and the chunk range are only touched by warm_step.  warm_read_ and warm_done_ are guarded by
+   // compact_mutex_
+   warmer* warmer_;
+   bool warm_posted_;
+   warmer::ticket_type warm_ticket_;
+   boost::scoped_ptr<leveldb::Iterator> warm_it_;
+   id_type warm_chunk_;
+   id_type warm_chunks_end_;
+   size_type warm_read_;
+   bool warm_done_;
+
+   id_set returned_; // items < TAIL that were reserved but later returned (not popped)
+   id_set expired_;  // items >= TAIL that the sweep erased, for pop_begin to step over
+
+   target_type expire_to_;
+   boost::asio::deadline_timer sweep_timer_;
+   bool sweep_armed_;
+   bool sweep_due_; // the journal had an expiry index when it was opened, so sweep once we can
+
+   // newly pushed items and chunks, so consumers that keep up can pop without going to the journal
+   fifo_cache<key_type> cache_;
+
+   // pushes and erases waiting on a group commit.  pushes are keyed from HEAD onward, and HEAD moves past them once
+   // committed
+   leveldb::WriteBatch group_;
+   size_type group_size_;
+   size_type group_erased_;
+   size_type group_bytes_; // of the pushes
+   bool commit_scheduled_;
+   bool group_sync_;
+   std::vector<push_callback> group_callbacks_;
+   std::vector<push_callback> group_synced_callbacks_; // synced pushes that will wait for the sync window
+
+   // synced pushes that are written, and waiting on the fsync at the end of the sync window
+   std::vector<push_callback> sync_window_callbacks_;
+   boost::asio::deadline_timer sync_window_timer_;
+
+   size_type unsynced_items_; // items pushed since the last sync
+   bool unsynced_writes_;     // anything written since the last sync
+   boost::posix_time::ptime last_sync_;
+   boost::asio::deadline_timer sync_timer_;
+   bool sync_timer_armed_;
 
    bool destroy_; // if true, we will delete the journal upon destruction
 
@@ -260,6 +706,7 @@ private:
 
    boost::asio::io_service& ios_;
    std::string path_;
+   options options_;
 };
 
 } // darner
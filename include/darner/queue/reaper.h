@@ -0,0 +1,94 @@
+#ifndef __DARNER_QUEUE_REAPER_H__
+#define __DARNER_QUEUE_REAPER_H__
+
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+
+namespace darner {
+
+/*
+ * reaper deletes destroyed journals on its own thread, so deleting or flushing a big queue doesn't block the event loop
+ * while its files are unlinked.  with a rate, it unlinks at most rate files per second, to go easy on the disk.
+ *
+ * a destroyed journal is marked as such (see queue::destroyed), and its mark is the last thing deleted.  so if the
+ * server stops before a journal is reaped, it's picked up again at the next startup.
+ *
+ * since it's the thread for slow filesystem work, it also counts how much of a drop_behind queue's journal is in the
+ * page cache, every count_ms.
+ *
+ * reap(), count_page_cache() and write_stats() are thread-safe.
+ */
+class reaper
+{
+public:
+
+   typedef boost::uint64_t size_type;
+
+   // how many bytes of a journal's files were in the page cache when it was last counted
+   class page_cache_count
+   {
+   public:
+
+      page_cache_count(const std::string& path) : path_(path), bytes_(0) {}
+
+      size_type bytes() const;
+
+      // counts again.  maps every file, so it's not cheap
+      void update();
+
+   private:
+
+      std::string path_;
+      mutable boost::mutex mutex_;
+      size_type bytes_;
+   };
+
+   reaper(size_type rate = 0, size_type count_ms = 10000);
+
+   // stops the thread, leaving any journals not yet deleted for the next startup
+   ~reaper();
+
+   // deletes the journal directory at path in the background
+   void reap(const std::string& path);
+
+   // counts the journal directory at path in the background, now and every count_ms for as long as the result is held
+   boost::shared_ptr<const page_cache_count> count_page_cache(const std::string& path);
+
+   // writes out reaping stats
+   void write_stats(std::ostringstream& out) const;
+
+private:
+
+   void run(const std::string& path);
+
+   void arm_count();
+
+   void count_timeout(const boost::system::error_code& e);
+
+   size_type rate_;
+   size_type count_ms_;
+
+   mutable boost::mutex mutex_;
+   bool stopping_;
+   size_type pending_;       // journals waiting or being deleted
+   size_type journals_reaped_;
+   size_type files_reaped_;
+   std::vector<boost::weak_ptr<page_cache_count> > counts_;
+
+   boost::asio::io_service ios_;
+   boost::scoped_ptr<boost::asio::io_service::work> work_;
+   boost::asio::deadline_timer count_timer_; // only touched on the thread
+   boost::thread thread_;
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_REAPER_H__
@@ -0,0 +1,158 @@
+#ifndef __DARNER_QUEUE_SEGMENT_JOURNAL_H__
+#define __DARNER_QUEUE_SEGMENT_JOURNAL_H__
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <leveldb/db.h>
+#include <leveldb/comparator.h>
+#include <leveldb/write_batch.h>
+
+namespace darner {
+
+/*
+ * segment_journal is an append-only alternative to leveldb for queue journals.  a queue only ever appends at its head
+ * and deletes at its tail, so rather than paying for leveldb's compactions and tombstones we:
+ *
+ * - append every write (a put, a delete, or a whole batch of them) to the active segment file as one checksummed record
+ * - keep an in-memory index of where each live key's value sits
+ * - roll to a new segment file once the active one reaches segment_size bytes
+ * - unlink the oldest segment file once every key written to it has been deleted
+ *
+ * segments are only ever reclaimed oldest-first, so a delete recorded in a segment can never outlive the put it undoes.
+ *
+ * segment_journal implements just enough of leveldb::DB for queue to use it in place of leveldb: snapshots are not
+ * supported, and iterators see writes made after they were created.  it is thread-safe.
+ */
+class segment_journal : public leveldb::DB
+{
+public:
+
+   typedef boost::uint64_t id_type;
+   typedef boost::uint64_t size_type;
+
+   // returns true if there is a segment journal at path
+   static bool exists(const std::string& path);
+
+   // open or create the segment journal at path.  keys are ordered by cmp, which must outlive the journal
+   static leveldb::Status open(const leveldb::Comparator* cmp, const std::string& path, size_type segment_size,
+      bool create_if_missing, leveldb::DB** result);
+
+   ~segment_journal();
+
+   leveldb::Status Put(const leveldb::WriteOptions& options, const leveldb::Slice& key, const leveldb::Slice& value);
+
+   leveldb::Status Delete(const leveldb::WriteOptions& options, const leveldb::Slice& key);
+
+   leveldb::Status Write(const leveldb::WriteOptions& options, leveldb::WriteBatch* updates);
+
+   leveldb::Status Get(const leveldb::ReadOptions& options, const leveldb::Slice& key, std::string* value);
+
+   leveldb::Iterator* NewIterator(const leveldb::ReadOptions& options);
+
+   const leveldb::Snapshot* GetSnapshot() { return NULL; }
+
+   void ReleaseSnapshot(const leveldb::Snapshot* snapshot) {}
+
+   // supports "darner.segments", the number of segment files on disk
+   bool GetProperty(const leveldb::Slice& property, std::string* value);
+
+   void GetApproximateSizes(const leveldb::Range* range, int n, uint64_t* sizes);
+
+   // segments reclaim themselves as they empty, so there's nothing to compact
+   void CompactRange(const leveldb::Slice* begin, const leveldb::Slice* end) {}
+
+private:
+
+   class iterator;
+   class record_builder;
+
+   // where a live value sits on disk
+   struct location
+   {
+      id_type segment;
+      size_type offset;
+      size_type size;
+   };
+
+   struct segment
+   {
+      segment(id_type _id, int _fd) : id(_id), fd(_fd), size(0), live(0), dirty(false) {}
+
+      id_type id;
+      int fd;
+      size_type size;
+      size_type live;  // number of index entries pointing into this segment
+      bool dirty;      // written to since the last fdatasync
+   };
+
+   // a single put or delete within a record
+   struct op
+   {
+      bool put;
+      std::string key;
+      size_type value_offset; // offset of the value from the start of the record
+      size_type value_size;
+   };
+
+   class key_less
+   {
+   public:
+      key_less(const leveldb::Comparator* cmp) : cmp_(cmp) {}
+      bool operator()(const std::string& a, const std::string& b) const { return cmp_->Compare(a, b) < 0; }
+   private:
+      const leveldb::Comparator* cmp_;
+   };
+
+   typedef std::map<std::string, location, key_less> index_type;
+
+   segment_journal(const leveldb::Comparator* cmp, const std::string& path, size_type segment_size);
+
+   // replays every segment on disk into the index
+   leveldb::Status recover();
+
+   // replays one segment.  a torn or corrupt record ends the segment: it's truncated there
+   leveldb::Status replay(segment& seg);
+
+   // starts a new active segment
+   leveldb::Status roll();
+
+   // points the index at the ops of a record written at offset of seg
+   void apply(const std::vector<op>& ops, segment& seg, size_type offset);
+
+   // drops a reference to a location's segment
+   void release(const location& loc);
+
+   // unlinks empty segments from the front
+   void reclaim();
+
+   // fdatasyncs any segment written to since its last sync
+   leveldb::Status sync();
+
+   leveldb::Status read(const location& loc, std::string& result);
+
+   segment* find_segment(id_type id);
+
+   std::string segment_path(id_type id) const;
+
+   const leveldb::Comparator* cmp_;
+   std::string path_;
+   size_type segment_size_;
+   int lock_fd_;
+
+   index_type index_;
+   std::deque<segment> segments_; // ordered by id, the back is the active segment
+
+   boost::mutex mutex_;
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_SEGMENT_JOURNAL_H__
@@ -0,0 +1,73 @@
+#ifndef __DARNER_QUEUE_WARMER_H__
+#define __DARNER_QUEUE_WARMER_H__
+
+#include <list>
+#include <sstream>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace darner {
+
+/*
+ * warmer reads the tails of freshly opened queues into the cache on its own thread, so the first pops after a restart
+ * don't all go to a cold disk.  a warm-up is a step that reads a little more of a queue's tail and returns how many
+ * bytes it read, or 0 once it's done.  queues take turns a step at a time, and with a rate, steps are spaced out so
+ * that on average no more than rate bytes are read per second, leaving the disk to live traffic.
+ *
+ * all methods are thread-safe.  the warmer must outlive every queue that posts to it.
+ */
+class warmer
+{
+public:
+
+   typedef boost::uint64_t size_type;
+   typedef boost::uint64_t ticket_type;
+   typedef boost::function<size_type ()> step_type;
+
+   // rate is in bytes per second, 0 for no limit
+   warmer(size_type rate = 0);
+
+   // stops the thread, dropping any warm-ups that aren't done
+   ~warmer();
+
+   // schedules a warm-up.  returns a ticket for cancel()
+   ticket_type post(const step_type& step);
+
+   // drops a warm-up, waiting out its step if one is running.  its step is never called after this returns
+   void cancel(ticket_type ticket);
+
+   // writes out warm-up stats
+   void write_stats(std::ostringstream& out) const;
+
+private:
+
+   struct pending
+   {
+      ticket_type ticket;
+      step_type step;
+   };
+
+   void work();
+
+   size_type rate_;
+   boost::posix_time::ptime next_step_; // when rate allows the next step
+   bool stopping_;
+   ticket_type next_ticket_;
+   std::list<pending> pending_; // round robin, the front goes next
+   bool running_;
+   ticket_type running_ticket_;
+
+   mutable boost::mutex mutex_;
+   boost::condition_variable changed_;
+   boost::thread thread_;
+
+   size_type warmups_;    // finished
+   size_type bytes_read_;
+};
+
+} // darner
+
+#endif // __DARNER_QUEUE_WARMER_H__
@@ -0,0 +1,145 @@
+#ifndef __DARNER_FIFO_CACHE_HPP__
+#define __DARNER_FIFO_CACHE_HPP__
+
+#include <map>
+#include <deque>
+#include <string>
+#include <utility>
+
+#include <boost/cstdint.hpp>
+
+namespace darner {
+
+/*
+ * fifo_cache holds values up to a budget of bytes.  when it's over budget, it evicts in the order values were put,
+ * regardless of how often they were read.  that's just right for a queue: the newest items are the ones about to be
+ * popped by consumers that are keeping up, and the oldest are the ones a lagging consumer will read from disk anyway.
+ *
+ * take() moves a value out rather than copying it, so a value is served from the cache at most once.
+ */
+template <class Key>
+class fifo_cache
+{
+public:
+
+   typedef boost::uint64_t size_type;
+
+   fifo_cache(size_type budget)
+   : budget_(budget),
+     bytes_(0),
+     seq_(0),
+     hits_(0),
+     misses_(0)
+   {
+   }
+
+   // caches a value, replacing any value already at key.  values bigger than the whole budget aren't cached
+   void put(const Key& key, const std::string& value)
+   {
+      erase(key);
+
+      if (!budget_ || value.size() > budget_)
+         return;
+
+      entry& e = entries_[key];
+      e.seq = ++seq_;
+      e.value = value;
+      order_.push_back(std::make_pair(e.seq, key));
+      bytes_ += value.size();
+
+      while (bytes_ > budget_)
+      {
+         typename entry_map::iterator it = entries_.find(order_.front().second);
+         if (it != entries_.end() && it->second.seq == order_.front().first)
+         {
+            bytes_ -= it->second.value.size();
+            entries_.erase(it);
+         }
+         order_.pop_front();
+      }
+   }
+
+   // moves the value at key into result and drops it from the cache.  returns false on a miss
+   bool take(const Key& key, std::string& result)
+   {
+      typename entry_map::iterator it = entries_.find(key);
+      if (it == entries_.end())
+      {
+         ++misses_;
+         return false;
+      }
+
+      ++hits_;
+      result.swap(it->second.value);
+      bytes_ -= result.size();
+      entries_.erase(it);
+      trim();
+      return true;
+   }
+
+   // the value at key, or NULL on a miss.  it's left in the cache, and doesn't count as a hit or a miss
+   const std::string* find(const Key& key) const
+   {
+      typename entry_map::const_iterator it = entries_.find(key);
+      return it == entries_.end() ? NULL : &it->second.value;
+   }
+
+   void erase(const Key& key)
+   {
+      typename entry_map::iterator it = entries_.find(key);
+      if (it == entries_.end())
+         return;
+
+      bytes_ -= it->second.value.size();
+      entries_.erase(it);
+      trim();
+   }
+
+   void clear()
+   {
+      entries_.clear();
+      order_.clear();
+      bytes_ = 0;
+   }
+
+   size_type bytes() const { return bytes_; }
+
+   size_type hits() const { return hits_; }
+
+   size_type misses() const { return misses_; }
+
+private:
+
+   struct entry
+   {
+      size_type seq; // matches the entry's place in order_
+      std::string value;
+   };
+
+   typedef std::map<Key, entry> entry_map;
+
+   // drops order_ entries for values that are already gone, so order_ doesn't grow while we're under budget
+   void trim()
+   {
+      while (!order_.empty())
+      {
+         typename entry_map::const_iterator it = entries_.find(order_.front().second);
+         if (it != entries_.end() && it->second.seq == order_.front().first)
+            break;
+         order_.pop_front();
+      }
+   }
+
+   size_type budget_;
+   size_type bytes_;
+   size_type seq_;
+   size_type hits_;
+   size_type misses_;
+
+   entry_map entries_;
+   std::deque<std::pair<size_type, Key> > order_; // oldest put first
+};
+
+} // darner
+
+#endif // __DARNER_FIFO_CACHE_HPP__
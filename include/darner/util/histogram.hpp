@@ -0,0 +1,57 @@
+#ifndef __DARNER_HISTOGRAM_HPP__
+#define __DARNER_HISTOGRAM_HPP__
+
+#include <cmath>
+
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+
+namespace darner {
+
+/*
+ * histogram counts values in power-of-two buckets, so recording one is a few shifts and it never grows.  a percentile
+ * comes back as the top of the bucket it falls in, so it's never under the real value and at most twice it.
+ */
+class histogram
+{
+public:
+
+   typedef boost::uint64_t value_type;
+   typedef boost::uint64_t size_type;
+
+   histogram() : count_(0) { buckets_.assign(0); }
+
+   // bucket 0 holds 0, and bucket i holds [2^(i-1), 2^i)
+   void record(value_type value)
+   {
+      size_t bucket = 0;
+      for (; value; value >>= 1)
+         ++bucket;
+      ++buckets_[bucket];
+      ++count_;
+   }
+
+   size_type count() const { return count_; }
+
+   // the top of the bucket the p quantile (0 < p <= 1) falls in, or 0 if nothing's been recorded
+   value_type percentile(double p) const
+   {
+      size_type rank = static_cast<size_type>(std::ceil(p * count_)), seen = 0;
+      for (size_t i = 0; i != buckets_.size() && count_; ++i)
+      {
+         seen += buckets_[i];
+         if (seen >= rank)
+            return i == buckets_.size() - 1 ? ~value_type(0) : (value_type(1) << i) - 1;
+      }
+      return 0;
+   }
+
+private:
+
+   boost::array<size_type, 65> buckets_;
+   size_type count_;
+};
+
+} // darner
+
+#endif // __DARNER_HISTOGRAM_HPP__
@@ -0,0 +1,145 @@
+#ifndef __DARNER_ID_SET_HPP__
+#define __DARNER_ID_SET_HPP__
+
+#include <map>
+#include <utility>
+#include <algorithm>
+
+#include <boost/cstdint.hpp>
+
+namespace darner {
+
+/*
+ * id_set is a set of ids that's stored as runs of consecutive ids, so a thousand items returned by a crashed consumer
+ * cost a few runs rather than a thousand tree nodes.  inserting an id or a range is O(log runs), and taking the lowest
+ * id is constant time and never allocates.
+ */
+class id_set
+{
+public:
+
+   typedef boost::uint64_t id_type;
+   typedef boost::uint64_t size_type;
+
+   id_set() : size_(0) {}
+
+   void insert(id_type id)
+   {
+      run_map::iterator it = runs_.lower_bound(id); // first run that ends at or after id
+
+      if (it != runs_.end() && it->first == id) // id is just past this run, so grow it up
+      {
+         id_type beg = it->second;
+         run_map::iterator next = it;
+         ++next;
+         runs_.erase(it);
+         if (next != runs_.end() && next->second == id + 1) // and that closes the gap to the next run
+            next->second = beg;
+         else
+            runs_.insert(next, std::make_pair(id + 1, beg));
+      }
+      else if (it != runs_.end() && it->second <= id)
+         return; // already have it
+      else if (it != runs_.end() && it->second == id + 1) // id is just before this run, so grow it down
+         it->second = id;
+      else
+         runs_.insert(it, std::make_pair(id + 1, id));
+
+      ++size_;
+   }
+
+   // inserts every id in [beg, end)
+   void insert(id_type beg, id_type end)
+   {
+      if (beg >= end)
+         return;
+
+      // swallow every run that overlaps or touches [beg, end)
+      run_map::iterator it = runs_.lower_bound(beg);
+      while (it != runs_.end() && it->second <= end)
+      {
+         beg = std::min(beg, it->second);
+         end = std::max(end, it->first);
+         size_ -= it->first - it->second;
+         runs_.erase(it++);
+      }
+
+      runs_.insert(it, std::make_pair(end, beg));
+      size_ += end - beg;
+   }
+
+   // removes every id below id
+   void erase_below(id_type id)
+   {
+      while (!runs_.empty() && runs_.begin()->first <= id)
+      {
+         size_ -= runs_.begin()->first - runs_.begin()->second;
+         runs_.erase(runs_.begin());
+      }
+      if (!runs_.empty() && runs_.begin()->second < id)
+      {
+         size_ -= id - runs_.begin()->second;
+         runs_.begin()->second = id;
+      }
+   }
+
+   // removes id, splitting its run if it's in the middle of one
+   void erase(id_type id)
+   {
+      run_map::iterator it = runs_.upper_bound(id); // first run that ends after id
+      if (it == runs_.end() || it->second > id)
+         return; // don't have it
+
+      id_type beg = it->second, end = it->first;
+      runs_.erase(it);
+      if (beg != id)
+         runs_.insert(std::make_pair(id, beg));
+      if (id + 1 != end)
+         runs_.insert(std::make_pair(end, id + 1));
+      --size_;
+   }
+
+   bool contains(id_type id) const
+   {
+      run_map::const_iterator it = runs_.upper_bound(id);
+      return it != runs_.end() && it->second <= id;
+   }
+
+   // the lowest id, and the end of the run it starts.  the set must not be empty
+   id_type front() const { return runs_.begin()->second; }
+   id_type front_end() const { return runs_.begin()->first; }
+
+   // removes and returns the lowest id.  the set must not be empty
+   id_type pop()
+   {
+      run_map::iterator it = runs_.begin();
+      id_type result = it->second++;
+      if (it->second == it->first)
+         runs_.erase(it);
+      --size_;
+      return result;
+   }
+
+   void clear()
+   {
+      runs_.clear();
+      size_ = 0;
+   }
+
+   bool empty() const { return runs_.empty(); }
+
+   size_type size() const { return size_; }
+
+   size_type runs() const { return runs_.size(); }
+
+private:
+
+   typedef std::map<id_type, id_type> run_map; // [beg, end) keyed by end, so popping from the front only moves beg
+
+   run_map runs_; // runs never overlap or touch
+   size_type size_;
+};
+
+} // darner
+
+#endif // __DARNER_ID_SET_HPP__
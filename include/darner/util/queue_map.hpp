@@ -3,37 +3,103 @@
 
 #include <string>
 #include <map>
+#include <algorithm>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
 
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "darner/queue/queue.h"
+#include "darner/queue/compactor.h"
+#include "darner/queue/reaper.h"
+#include "darner/queue/warmer.h"
+#include "darner/util/log.h"
 
 namespace darner {
 
-// maps a queue name to a queue instance, reloads queues
+/*
+ * maps a queue name to a queue instance, reloads queues.  its queues share one compactor, one reaper and one warmer.
+ *
+ * journals are opened on first use.  a queue that closed cleanly is known at startup by its summary (see
+ * queue::summary), so its journal stays closed until it's needed.  with max_open, the least recently used idle queue
+ * is closed to make room for another, and with idle_ms, queues that go unused that long are closed.  only queues that
+ * nobody else holds and that are idle (see queue::idle) are closed.
+ *
+ * queues that do have to be opened at startup, because they didn't close cleanly, are recovered recovery_threads at a
+ * time
+ */
 class queue_map
 {
 private:
 
    typedef std::map<std::string, boost::shared_ptr<queue> > container_type;
+   typedef std::map<std::string, queue::summary_type> closed_map;
 
 public:
 
+   // iterates the open queues
    typedef container_type::iterator iterator;
    typedef container_type::const_iterator const_iterator;
 
-   queue_map(boost::asio::io_service& ios, const std::string& data_path)
-   : data_path_(data_path), ios_(ios)
+   // per-queue options that override the defaults, by queue name
+   typedef std::map<std::string, queue::options> options_map;
+
+   /*
+    * up to compactions compactions run at once, reading and writing at most compaction_rate bytes per second.
+    * destroyed journals are deleted at reap_rate files per second.  with a block_cache_size, every queue shares one leveldb
+    * block cache of that many bytes, instead of each having its own.  max_open and idle_ms are 0 for no limit.  queue
+    * tails are warmed up at warm_rate bytes per second, 0 for no limit
+    */
+   queue_map(boost::asio::io_service& ios, const std::string& data_path,
+      const queue::options& defaults = queue::options(), const options_map& overrides = options_map(),
+      size_t compactions = 1, queue::size_type compaction_rate = 0, queue::size_type reap_rate = 0,
+      queue::size_type block_cache_size = 0, size_t max_open = 0, queue::size_type idle_ms = 0,
+      size_t recovery_threads = 1, queue::size_type warm_rate = 0)
+   : block_cache_(block_cache_size ? leveldb::NewLRUCache(block_cache_size) : NULL), reaper_(reap_rate),
+     warmer_(warm_rate),
+     compactor_(compactions, compaction_rate), max_open_(max_open), idle_ms_(idle_ms), idle_timer_(ios),
+     closes_(0), recovery_ms_(0), data_path_(data_path), ios_(ios), defaults_(defaults), overrides_(overrides)
    {
+      std::vector<std::string> recover;
       boost::filesystem::directory_iterator end_it;
       for (boost::filesystem::directory_iterator it(data_path_); it != end_it; ++it)
       {
+         if (queue::abandoned(it->path().string())) // marked first, so it's still known if we stop before it's gone
+            queue::mark_destroyed(it->path().string());
+         if (queue::destroyed(it->path().string())) // left over from before a restart
+         {
+            reaper_.reap(it->path().string());
+            continue;
+         }
          std::string queue_name =
             boost::filesystem::path(it->path().filename()).string(); // useless recast for boost backwards compat
-         queues_[queue_name] = boost::make_shared<queue>(boost::ref(ios_), (data_path_ / queue_name).string());
+         queue::summary_type summary;
+         if (queue::migrating(it->path().string())) // left over from a migration, its queue finishes or cleans it up
+            queue_name.erase(queue_name.rfind('.'));
+         else if (queue::summary(it->path().string(), summary))
+         {
+            closed_[queue_name] = summary;
+            continue;
+         }
+         recover.push_back(queue_name); // no summary, so we have to open it to know what's in it
       }
+
+      std::sort(recover.begin(), recover.end());
+      recover.erase(std::unique(recover.begin(), recover.end()), recover.end());
+      for (std::vector<std::string>::const_iterator it = recover.begin(); it != recover.end(); ++it)
+         closed_.erase(*it); // a migration's queue may have been seen before its scratch space
+      if (!recover.empty())
+         open_all(recover, recovery_threads);
+
+      if (idle_ms_)
+         arm_idle_timer();
    }
 
    boost::shared_ptr<queue> operator[] (const std::string& queue_name)
@@ -41,8 +107,9 @@ public:
       iterator it = queues_.find(queue_name);
 
       if (it == queues_.end())
-         it = queues_.insert(container_type::value_type(queue_name,
-            boost::make_shared<queue>(boost::ref(ios_), (data_path_ / queue_name).string()))).first;
+         it = open(queue_name);
+      else
+         used_[queue_name] = boost::posix_time::microsec_clock::universal_time();
 
       return it->second;
    }
@@ -52,14 +119,68 @@ public:
       iterator it = queues_.find(queue_name);
 
       if (it == queues_.end())
-         return;
+      {
+         if (closed_.find(queue_name) == closed_.end())
+            return;
+         it = open(queue_name); // it has to be open to be destroyed
+      }
 
       it->second->destroy();
 
       queues_.erase(it);
+      used_.erase(queue_name);
 
       if (recreate)
-         queues_[queue_name] = boost::make_shared<queue>(boost::ref(ios_), (data_path_ / queue_name).string());
+         open(queue_name);
+   }
+
+   // flushes a queue.  a closed queue is only opened if it has items, and one that doesn't exist isn't created
+   void flush(const std::string& queue_name)
+   {
+      iterator it = queues_.find(queue_name);
+      if (it != queues_.end())
+         it->second->flush();
+      else
+      {
+         closed_map::const_iterator closed_it = closed_.find(queue_name);
+         if (closed_it != closed_.end() && closed_it->second.items)
+            (*this)[queue_name]->flush();
+      }
+   }
+
+   // flushes every queue, opening closed queues that have items
+   void flush_all()
+   {
+      for (iterator it = queues_.begin(); it != queues_.end(); ++it)
+         it->second->flush();
+      closed_map closed = closed_;
+      for (closed_map::const_iterator it = closed.begin(); it != closed.end(); ++it)
+      {
+         if (it->second.items)
+            (*this)[it->first]->flush();
+      }
+   }
+
+   // writes out block cache, compaction, reaping and warm-up stats, then every queue's stats
+   void write_stats(std::ostringstream& out) const
+   {
+      if (block_cache_)
+         out << "STAT block_cache_bytes " << block_cache_->TotalCharge() << "\r\n";
+      compactor_.write_stats(out);
+      reaper_.write_stats(out);
+      warmer_.write_stats(out);
+      out << "STAT queues_open " << queues_.size() << "\r\n";
+      out << "STAT queues_closed " << closed_.size() << "\r\n";
+      out << "STAT queue_closes " << closes_ << "\r\n";
+      out << "STAT recovery_ms " << recovery_ms_ << "\r\n";
+      for (const_iterator it = queues_.begin(); it != queues_.end(); ++it)
+         it->second->write_stats(it->first, out);
+      for (closed_map::const_iterator it = closed_.begin(); it != closed_.end(); ++it)
+      {
+         out << "STAT queue_" << it->first << "_items " << it->second.items << "\r\n";
+         out << "STAT queue_" << it->first << "_bytes " << it->second.bytes << "\r\n";
+         out << "STAT queue_" << it->first << "_age_ms " << it->second.age_ms() << "\r\n";
+      }
    }
 
    iterator begin()             { return queues_.begin(); }
@@ -69,10 +190,187 @@ public:
 
 private:
 
-   std::map<std::string, boost::shared_ptr<queue> > queues_;
+   boost::shared_ptr<queue> make_queue(const std::string& queue_name)
+   {
+      queue::options options = options_for(queue_name);
+      options.block_cache = block_cache_.get();
+
+      boost::shared_ptr<queue> result = boost::make_shared<queue>(boost::ref(ios_), (data_path_ / queue_name).string(),
+         options, &compactor_, &reaper_, &warmer_);
+      if (!options.expire_to.empty() && options.expire_to != queue_name) // opened if it's closed, like any other use
+         result->expire_to(boost::bind(&queue_map::operator[], this, options.expire_to));
+      return result;
+   }
+
+   // a queue's overrides, or the defaults.  an override whose name ends in * covers every queue whose name starts with
+   // the rest of it, and the longest one wins
+   const queue::options& options_for(const std::string& queue_name) const
+   {
+      options_map::const_iterator it = overrides_.find(queue_name), best = overrides_.end();
+      if (it != overrides_.end())
+         return it->second;
+      for (it = overrides_.begin(); it != overrides_.end(); ++it)
+      {
+         const std::string& pattern = it->first;
+         if (!pattern.empty() && pattern[pattern.size() - 1] == '*' &&
+            queue_name.compare(0, pattern.size() - 1, pattern, 0, pattern.size() - 1) == 0 &&
+            (best == overrides_.end() || pattern.size() > best->first.size()))
+            best = it;
+      }
+      return best == overrides_.end() ? defaults_ : best->second;
+   }
+
+   // opens a queue, closing the least recently used idle queue first if we're at max_open
+   iterator open(const std::string& queue_name)
+   {
+      if (max_open_ && queues_.size() >= max_open_)
+         close_lru();
+
+      closed_.erase(queue_name);
+      used_[queue_name] = boost::posix_time::microsec_clock::universal_time();
+      return queues_.insert(container_type::value_type(queue_name, make_queue(queue_name))).first;
+   }
+
+   // opens queues on up to threads threads at once, then closes any over max_open
+   void open_all(const std::vector<std::string>& names, size_t threads)
+   {
+      boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+      recovery r(*this, names);
+      boost::thread_group workers;
+      for (size_t i = 0; i < std::min(threads ? threads : 1, names.size()); ++i)
+         workers.create_thread(boost::bind(&recovery::work, &r));
+      workers.join_all();
+      if (!r.error.empty())
+         throw std::runtime_error(r.error);
+
+      for (size_t i = 0; i != names.size(); ++i)
+      {
+         queues_[names[i]] = r.opened[i];
+         used_[names[i]] = start;
+      }
+      while (max_open_ && queues_.size() > max_open_ && close_lru())
+         ;
+
+      recovery_ms_ = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+      log::INFO("recovered %1% queues in %2%ms", names.size(), recovery_ms_);
+   }
+
+   // a queue recovery shared by the threads doing it
+   struct recovery
+   {
+      recovery(queue_map& _map, const std::vector<std::string>& _names)
+      : map(_map), names(_names), opened(_names.size()), next(0) {}
+
+      void work()
+      {
+         for (;;)
+         {
+            size_t i;
+            {
+               boost::mutex::scoped_lock lock(mutex);
+               if (next == names.size() || !error.empty())
+                  return;
+               i = next++;
+            }
+            try
+            {
+               opened[i] = map.make_queue(names[i]);
+            }
+            catch (const std::exception& ex)
+            {
+               boost::mutex::scoped_lock lock(mutex);
+               if (error.empty())
+                  error = ex.what();
+            }
+         }
+      }
+
+      queue_map& map;
+      const std::vector<std::string>& names;
+      std::vector<boost::shared_ptr<queue> > opened;
+      size_t next;
+      std::string error;
+      boost::mutex mutex;
+   };
+
+   // closes the least recently used queue that can be closed.  returns false if they're all busy
+   bool close_lru()
+   {
+      iterator lru = queues_.end();
+      for (iterator it = queues_.begin(); it != queues_.end(); ++it)
+      {
+         if (closable(it) && (lru == queues_.end() || used_[it->first] < used_[lru->first]))
+            lru = it;
+      }
+      if (lru == queues_.end()) // if everything's busy, we go over for now
+         return false;
+      close(lru);
+      return true;
+   }
+
+   bool closable(iterator it) const
+   {
+      return it->second.unique() && it->second->idle();
+   }
+
+   // closes a queue's journal, remembering its summary
+   void close(iterator it)
+   {
+      queue::summary_type& summary = closed_[it->first];
+      summary.items = it->second->count();
+      summary.bytes = it->second->bytes();
+      summary.pushed = it->second->oldest_pushed();
+      used_.erase(it->first);
+      queues_.erase(it);
+      ++closes_;
+   }
+
+   void arm_idle_timer()
+   {
+      idle_timer_.expires_from_now(boost::posix_time::milliseconds(idle_ms_));
+      idle_timer_.async_wait(boost::bind(&queue_map::close_idle, this, boost::asio::placeholders::error));
+   }
+
+   void close_idle(const boost::system::error_code& e)
+   {
+      if (e)
+         return; // we're going away
+
+      boost::posix_time::ptime cutoff =
+         boost::posix_time::microsec_clock::universal_time() - boost::posix_time::milliseconds(idle_ms_);
+      for (iterator it = queues_.begin(); it != queues_.end();)
+      {
+         if (used_[it->first] <= cutoff && closable(it))
+            close(it++);
+         else
+            ++it;
+      }
+
+      arm_idle_timer();
+   }
+
+   // these outlive queues_: journals use the block cache, queue dtors wait on the compactor, cancel their warm-ups, and
+   // hand their journals to the reaper
+   boost::scoped_ptr<leveldb::Cache> block_cache_;
+   reaper reaper_;
+   warmer warmer_;
+   compactor compactor_;
+
+   size_t max_open_;
+   queue::size_type idle_ms_;
+   boost::asio::deadline_timer idle_timer_;
+   queue::size_type closes_;
+   queue::size_type recovery_ms_; // how long startup took to open the queues that needed it
+
+   container_type queues_;
+   std::map<std::string, boost::posix_time::ptime> used_; // when each open queue was last asked for
+   closed_map closed_; // summaries of queues whose journals are closed
 
    boost::filesystem::path data_path_;
    boost::asio::io_service& ios_;
+   queue::options defaults_;
+   options_map overrides_;
 };
 
 } // darner
@@ -6,6 +6,7 @@
 #include <boost/thread.hpp>
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 #include "darner/util/log.h"
 #include "darner/net/server.hpp"
@@ -29,13 +30,97 @@ int main(int argc, char * argv[])
 
    // options allow both on command line and in a config file
    int port;
+   size_t max_open_items;
+   size_t compactions;
+   queue::size_type compaction_rate;
+   queue::size_type reap_rate;
+   queue::size_type block_cache_size;
+   size_t max_open_queues;
+   queue::size_type queue_idle_ms;
+   size_t recovery_threads;
+   queue::size_type warm_rate;
    string data_path;
+   string journal;
+   string sync_journal;
+   string compression;
+   string drop_behind;
+   string memory_full;
+   string when_full;
+   queue::options queue_options;
 
    po::options_description config("Configuration");
    config.add_options()
       ("debug", "debug (verbose) output")
       ("port,p", po::value<int>(&port)->default_value(22133), "port upon which to listen")
       ("data,d", po::value<string>(&data_path)->default_value("data"), "data directory")
+      ("max_open_items", po::value<size_t>(&max_open_items)->default_value(1),
+         "items a connection may hold open at once")
+      ("compactions", po::value<size_t>(&compactions)->default_value(1),
+         "journal compactions that may run at once, across all queues")
+      ("compaction_rate", po::value<queue::size_type>(&compaction_rate)->default_value(0),
+         "bytes per second that compactions may read and write, 0 for no limit")
+      ("reap_rate", po::value<queue::size_type>(&reap_rate)->default_value(0),
+         "files per second to unlink from deleted queues, 0 for no limit")
+      ("block_cache_size", po::value<queue::size_type>(&block_cache_size)->default_value(0),
+         "bytes of leveldb block cache shared by all queues, 0 for a cache per queue")
+      ("max_open_queues", po::value<size_t>(&max_open_queues)->default_value(0),
+         "queue journals to keep open at once, closing the least recently used, 0 for no limit")
+      ("queue_idle_ms", po::value<queue::size_type>(&queue_idle_ms)->default_value(0),
+         "close a queue's journal after this many milliseconds unused, 0 to keep it open")
+      ("recovery_threads", po::value<size_t>(&recovery_threads)->default_value(4),
+         "queues to open at once at startup, when they weren't shut down cleanly")
+      ("warm_rate", po::value<queue::size_type>(&warm_rate)->default_value(8388608),
+         "bytes per second to read when warming up queue tails, across all queues, 0 for no limit")
+      ("journal", po::value<string>(&journal)->default_value("leveldb"),
+         "journal type for new queues: leveldb, segment or memory")
+      ("segment_size", po::value<queue::size_type>(&queue_options.segment_size)->default_value(
+         queue_options.segment_size), "bytes per segment file in segment journals")
+      ("memory_limit", po::value<queue::size_type>(&queue_options.memory_limit)->default_value(
+         queue_options.memory_limit), "bytes a memory journal holds before it's full")
+      ("memory_full", po::value<string>(&memory_full)->default_value("spill"),
+         "what a full memory journal does: spill to leveldb, or drop new items")
+      ("cache_size", po::value<queue::size_type>(&queue_options.cache_size)->default_value(
+         queue_options.cache_size), "bytes of newly pushed items each queue keeps in memory for pops")
+      ("read_ahead", po::value<queue::size_type>(&queue_options.read_ahead)->default_value(
+         queue_options.read_ahead), "items or chunks to read ahead when a pop misses the cache")
+      ("compact_bytes", po::value<queue::size_type>(&queue_options.compact_bytes)->default_value(
+         queue_options.compact_bytes), "bytes of popped items after which a queue compacts its journal")
+      ("chunk_size", po::value<queue::size_type>(&queue_options.chunk_size)->default_value(
+         queue_options.chunk_size), "bytes per chunk when streaming in a set")
+      ("max_chunk_size", po::value<queue::size_type>(&queue_options.max_chunk_size)->default_value(
+         queue_options.max_chunk_size), "larger sets stream in bigger chunks, up to this many bytes, 0 for never")
+      ("warm_bytes", po::value<queue::size_type>(&queue_options.warm_bytes)->default_value(
+         queue_options.warm_bytes), "bytes of a queue's tail to read into the cache when it's opened, 0 for none")
+      ("blob_threshold", po::value<queue::size_type>(&queue_options.blob_threshold)->default_value(
+         queue_options.blob_threshold), "items over this many bytes are kept in blob files, 0 for never")
+      ("blob_file_size", po::value<queue::size_type>(&queue_options.blob_file_size)->default_value(
+         queue_options.blob_file_size), "bytes per blob file")
+      ("max_age_ms", po::value<queue::size_type>(&queue_options.max_age_ms)->default_value(
+         queue_options.max_age_ms), "milliseconds after a set that its item expires, 0 for never")
+      ("expire_to", po::value<string>(&queue_options.expire_to)->default_value(""),
+         "queue to move expired items to, or empty to erase them")
+      ("sweep_ms", po::value<queue::size_type>(&queue_options.sweep_ms)->default_value(
+         queue_options.sweep_ms), "milliseconds between sweeps for expired items")
+      ("max_items", po::value<queue::size_type>(&queue_options.max_items)->default_value(
+         queue_options.max_items), "the most items a queue holds, 0 for no limit")
+      ("max_bytes", po::value<queue::size_type>(&queue_options.max_bytes)->default_value(
+         queue_options.max_bytes), "the most bytes of items a queue holds, 0 for no limit")
+      ("when_full", po::value<string>(&when_full)->default_value("reject"),
+         "what a queue at max_items or max_bytes does: reject sets, or discard_old items")
+      ("sync_window_ms", po::value<queue::size_type>(&queue_options.sync_window_ms)->default_value(
+         queue_options.sync_window_ms), "milliseconds to gather /sync sets into one fsync")
+      ("sync_journal", po::value<string>(&sync_journal)->default_value("never"),
+         "when else to fsync journals: never, always, every <N>ms, or every <N>items")
+      ("write_buffer_size", po::value<queue::size_type>(&queue_options.write_buffer_size)->default_value(
+         queue_options.write_buffer_size), "bytes of writes each leveldb journal holds in memory")
+      ("block_size", po::value<queue::size_type>(&queue_options.block_size)->default_value(
+         queue_options.block_size), "bytes per leveldb table block")
+      ("max_open_files", po::value<queue::size_type>(&queue_options.max_open_files)->default_value(
+         queue_options.max_open_files), "table files each leveldb journal keeps open")
+      ("compression", po::value<string>(&compression)->default_value("on"),
+         "snappy compress leveldb journals: on or off")
+      ("drop_behind", po::value<string>(&drop_behind)->default_value("off"),
+         "drop popped journal and blob data from the page cache: on or off")
   ;
 
    po::options_description cmdline_options;
@@ -68,6 +153,9 @@ int main(int argc, char * argv[])
       return 0;
    }
 
+   // options for a single queue go in a [queue.<name>] section of the config file
+   vector<po::option> queue_settings;
+
    if (vm.count("config"))
    {
       ifstream in(config_path.c_str());
@@ -78,7 +166,8 @@ int main(int argc, char * argv[])
       }
       else
       {
-         po::store(po::parse_config_file(in, config_file_options), vm);
+         po::parsed_options parsed = po::parse_config_file(in, config_file_options, true);
+         po::store(parsed, vm);
          try
          {
             notify(vm);
@@ -88,6 +177,84 @@ int main(int argc, char * argv[])
             cerr << "error reading config file: " << e.what() << endl;
             return 1;
          }
+         for (vector<po::option>::const_iterator it = parsed.options.begin(); it != parsed.options.end(); ++it)
+         {
+            if (!it->unregistered)
+               continue;
+            if (!algorithm::starts_with(it->string_key, "queue.") || it->value.empty())
+            {
+               cerr << "error reading config file: unknown option " << it->string_key << endl;
+               return 1;
+            }
+            queue_settings.push_back(*it);
+         }
+      }
+   }
+
+   if (!queue_options.set("journal", journal))
+   {
+      cerr << "unknown journal type: " << journal << endl;
+      return 1;
+   }
+
+   if (!queue_options.set("memory_full", memory_full))
+   {
+      cerr << "bad memory_full: " << memory_full << endl;
+      return 1;
+   }
+
+   if (!queue_options.set("when_full", when_full))
+   {
+      cerr << "bad when_full: " << when_full << endl;
+      return 1;
+   }
+
+   if (!queue_options.set("sync_journal", sync_journal))
+   {
+      cerr << "bad sync_journal: " << sync_journal << endl;
+      return 1;
+   }
+
+   if (!queue_options.set("compression", compression))
+   {
+      cerr << "bad compression: " << compression << endl;
+      return 1;
+   }
+
+   if (!queue_options.set("drop_behind", drop_behind))
+   {
+      cerr << "bad drop_behind: " << drop_behind << endl;
+      return 1;
+   }
+
+   if (!queue_options.chunk_size)
+   {
+      cerr << "chunk_size must be at least 1" << endl;
+      return 1;
+   }
+
+   if (!queue_options.sweep_ms)
+   {
+      cerr << "sweep_ms must be at least 1" << endl;
+      return 1;
+   }
+
+   queue_map::options_map queue_overrides;
+   for (vector<po::option>::const_iterator it = queue_settings.begin(); it != queue_settings.end(); ++it)
+   {
+      // queue.<name>.<option>, and queue names may have dots in them
+      string::size_type dot = it->string_key.rfind('.');
+      bool ok = dot > 6;
+      if (ok)
+      {
+         queue::options& options = queue_overrides.insert(
+            queue_map::options_map::value_type(it->string_key.substr(6, dot - 6), queue_options)).first->second;
+         ok = options.set(it->string_key.substr(dot + 1), it->value[0]);
+      }
+      if (!ok)
+      {
+         cerr << "error reading config file: bad queue option " << it->string_key << " = " << it->value[0] << endl;
+         return 1;
       }
    }
 
@@ -116,7 +283,8 @@ int main(int argc, char * argv[])
 
    log::INFO("starting up");
 
-   server srv(data_path, port);
+   server srv(data_path, port, queue_options, queue_overrides, max_open_items, compactions, compaction_rate,
+      reap_rate, block_cache_size, max_open_queues, queue_idle_ms, recovery_threads, warm_rate);
 
    // Restore previous signals.
    pthread_sigmask(SIG_SETMASK, &old_mask, 0);
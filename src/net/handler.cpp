@@ -1,6 +1,11 @@
 #include "darner/net/handler.h"
 
 #include <cstdio>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <boost/array.hpp>
 
@@ -13,13 +18,15 @@ handler::handler(io_service& ios,
                  request_parser& parser,
                  queue_map& queues,
                  stats& _stats,
-                 queue::size_type chunk_size /* = 1024 */)
-   : chunk_size_(chunk_size),
+                 queue::size_type max_chunk_size /* = 1024 */,
+                 size_t max_open_items /* = 1 */)
+   : max_open_items_(max_open_items),
+     chunk_size_(max_chunk_size),
      socket_(ios),
      parser_(parser),
      queues_(queues),
      stats_(_stats),
-     in_(chunk_size + 2) // make room for \r\n
+     in_(max_chunk_size + 2) // make room for \r\n
 {
 }
 
@@ -75,9 +82,7 @@ void handler::write_stats()
 {
    ostringstream oss;
    stats_.write(oss);
-
-   for (queue_map::const_iterator it = queues_.begin(); it != queues_.end(); ++it)
-      it->second->write_stats(it->first, oss);
+   queues_.write_stats(oss);
 
    oss << "END\r\n";
    buf_ = oss.str();
@@ -99,23 +104,44 @@ void handler::destroy()
 
 void handler::flush()
 {
-   // TODO: flush should guarantee that an item that's halfway pushed should still appear after
-   // the flush.  right now, item will only appear to a client that was waiting to pop before the flush 
-   queues_.erase(req_.queue, true);
+   try
+   {
+      queues_.flush(req_.queue);
+   }
+   catch (const system::system_error& ex)
+   {
+      return error("flush", ex);
+   }
    return end();
 }
 
 void handler::flush_all()
 {
-   for (queue_map::iterator it = queues_.begin(); it != queues_.end(); ++it)
-      queues_.erase(it->first, true);
+   try
+   {
+      queues_.flush_all();
+   }
+   catch (const system::system_error& ex)
+   {
+      return error("flush_all", ex);
+   }
    return end("Flushed all queues.\r\n");
 }
 
 void handler::set()
 {
    // round up the number of chunks we need, and fetch \r\n if it's just one chunk
-   push_stream_.open(queues_[req_.queue], (req_.num_bytes + chunk_size_ - 1) / chunk_size_, req_.set_sync);
+   shared_ptr<queue> q = queues_[req_.queue];
+   chunk_size_ = q->chunk_size(req_.num_bytes);
+   try
+   {
+      push_stream_.open(q, (req_.num_bytes + chunk_size_ - 1) / chunk_size_, req_.set_sync, req_.num_bytes,
+         req_.set_expiration);
+   }
+   catch (const system::system_error& ex)
+   {
+      return error("set", ex);
+   }
    queue::size_type remaining = req_.num_bytes - push_stream_.tell();
    queue::size_type required = remaining > chunk_size_ ? chunk_size_ : remaining + 2;
 
@@ -131,8 +157,9 @@ void handler::set_on_read_chunk(const system::error_code& e, size_t bytes_transf
 
    asio::streambuf::const_buffers_type bufs = in_.data();
    queue::size_type bytes_remaining = req_.num_bytes - push_stream_.tell();
+   bool last_chunk = bytes_remaining <= chunk_size_;
 
-   if (bytes_remaining <= chunk_size_) // last chunk!  make sure it ends with \r\n
+   if (last_chunk) // last chunk!  make sure it ends with \r\n
    {
       buf_.assign(buffers_begin(bufs) + bytes_remaining, buffers_begin(bufs) + bytes_remaining + 2);
       if (buf_ != "\r\n")
@@ -148,6 +175,9 @@ void handler::set_on_read_chunk(const system::error_code& e, size_t bytes_transf
 
    try
    {
+      if (last_chunk) // we're all done, once the queue commits the item
+         return push_stream_.write(buf_, bind(&handler::set_on_commit, shared_from_this(), _1));
+
       push_stream_.write(buf_);
    }
    catch (const system::system_error& ex)
@@ -155,12 +185,6 @@ void handler::set_on_read_chunk(const system::error_code& e, size_t bytes_transf
       return error("set_on_read_chunk", ex);
    }
 
-   if (push_stream_.tell() == req_.num_bytes) // are we all done?
-   {
-      ++stats_.items_enqueued;
-      return end("STORED\r\n");
-   }
-
    // otherwise, second verse, same as the first
    queue::size_type remaining = req_.num_bytes - push_stream_.tell();
    queue::size_type required = remaining > chunk_size_ ? chunk_size_ : remaining + 2;
@@ -169,6 +193,17 @@ void handler::set_on_read_chunk(const system::error_code& e, size_t bytes_transf
       bind(&handler::set_on_read_chunk, shared_from_this(), _1, _2));
 }
 
+void handler::set_on_commit(const system::error_code& e)
+{
+   if (e == asio::error::no_buffer_space) // the queue's at its limits.  not our fault, so stay connected
+      return end("SERVER_ERROR queue full\r\n");
+   else if (e)
+      return error("set_on_commit", system::system_error(e));
+
+   ++stats_.items_enqueued;
+   end("STORED\r\n");
+}
+
 void handler::get()
 {
    if (req_.get_abort && (req_.get_open || req_.get_close || req_.get_peek))
@@ -179,9 +214,13 @@ void handler::get()
 
    if (req_.get_abort || req_.get_close)
    {
+      // every open item is closed together.  the queue writes all their erases in one batch
       try
       {
          pop_stream_.close(req_.get_close);
+         for (ptr_vector<iqstream>::iterator it = open_streams_.begin(); it != open_streams_.end(); ++it)
+            it->close(req_.get_close);
+         open_streams_.clear();
       }
       catch (const system::system_error& ex)
       {
@@ -189,12 +228,29 @@ void handler::get()
       }
    }
    else if (pop_stream_)
-      return error("close current item first", "CLIENT_ERROR");
+   {
+      if (open_streams_.size() + 1 >= max_open_items_)
+         return error("close current item first", "CLIENT_ERROR");
+
+      // set the open item aside, pop_stream_ is free for the next one
+      open_streams_.push_back(new iqstream());
+      open_streams_.back().swap(pop_stream_);
+   }
 
    if ((req_.get_close && !req_.get_open) || req_.get_abort)
       return end(); // closes/aborts go no further
 
-   if (!pop_stream_.open(queues_[req_.queue]))
+   bool opened;
+   try
+   {
+      opened = pop_stream_.open(queues_[req_.queue]); // reads the item in, stepping past any that have expired
+   }
+   catch (const system::system_error& ex)
+   {
+      return error("get", ex);
+   }
+
+   if (!opened)
    {
       if (req_.wait_ms) // couldn't read... can we at least wait?
          return queues_[req_.queue]->wait(req_.wait_ms, bind(&handler::get_on_queue_return, shared_from_this(), _1));
@@ -234,6 +290,12 @@ void handler::get()
    else
    {
       array<const_buffer, 2> bufs = {{ buffer(header_buf_), buffer(buf_) }};
+#ifdef __linux__
+      int fd;
+      queue::size_type offset;
+      if (pop_stream_.blob(fd, offset)) // the rest goes straight from the blob file
+         return async_write(socket_, bufs, bind(&handler::get_on_send_blob, shared_from_this(), _1, _2));
+#endif
       async_write(socket_, bufs, bind(&handler::get_on_write_chunk, shared_from_this(), _1, _2));
    }
 }
@@ -284,3 +346,43 @@ void handler::get_on_write_chunk(const boost::system::error_code& e, size_t byte
       async_write(socket_, buffer(buf_), bind(&handler::get_on_write_chunk, shared_from_this(), _1, _2));
    }
 }
+
+void handler::get_on_send_blob(const boost::system::error_code& e, size_t bytes_transferred)
+{
+   if (e)
+      return error("get_on_send_blob", e);
+
+#ifdef __linux__
+   // sendfile copies from the page cache to the socket in the kernel.  when the socket's full, we wait until it's
+   // writable again rather than block the loop
+   socket_.native_non_blocking(true);
+   while (pop_stream_.tell() != pop_stream_.size())
+   {
+      int fd;
+      queue::size_type offset;
+      ssize_t sent;
+      try
+      {
+         pop_stream_.blob(fd, offset);
+         off_t pos = offset;
+         sent = ::sendfile(socket_.native_handle(), fd, &pos, pop_stream_.size() - pop_stream_.tell());
+         if (sent > 0)
+            pop_stream_.skip(sent);
+      }
+      catch (const system::system_error& ex)
+      {
+         return error("get_on_send_blob", ex.code());
+      }
+
+      if (sent < 0 && errno == EINTR)
+         continue;
+      else if (sent < 0 && errno == EAGAIN)
+         return socket_.async_write_some(null_buffers(),
+            bind(&handler::get_on_send_blob, shared_from_this(), _1, _2));
+      else if (sent <= 0) // a short blob file is bad data
+         return error("get_on_send_blob", system::error_code(sent < 0 ? errno : EIO, system::system_category()));
+   }
+#endif
+
+   get_on_write_chunk(e, 0); // all sent, so finish up
+}
@@ -43,7 +43,7 @@ request_grammar::request_grammar()
       >> ' '
       >> uint_ // flags (ignored)
       >> ' '
-      >> uint_ // expiration (ignored for now)
+      >> uint_         [phoenix::ref(req.set_expiration) = _1]
       >> ' '
       >> uint_         [phoenix::ref(req.num_bytes) = _1];
 
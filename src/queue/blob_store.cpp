@@ -0,0 +1,174 @@
+#include "darner/queue/blob_store.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include "darner/util/log.h"
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+namespace {
+
+const char* blob_suffix = ".blob";
+
+void io_error()
+{
+   throw system::system_error(system::errc::io_error, asio::error::get_system_category());
+}
+
+} // anonymous
+
+blob_store::blob_store(const string& path, size_type file_size)
+: bytes_(0),
+  path_(path),
+  file_size_(file_size)
+{
+   filesystem::directory_iterator end_it;
+   for (filesystem::directory_iterator it(path_); it != end_it; ++it)
+   {
+      string name = filesystem::path(it->path().filename()).string(); // useless recast for boost backwards compat
+      if (name.size() <= strlen(blob_suffix) || name.compare(name.size() - strlen(blob_suffix), string::npos,
+         blob_suffix) != 0)
+         continue;
+      id_type file;
+      try
+      {
+         file = lexical_cast<id_type>(name.substr(0, name.size() - strlen(blob_suffix)));
+      }
+      catch (const bad_lexical_cast&)
+      {
+         continue; // not one of ours
+      }
+
+      int fd = ::open(file_path(file).c_str(), O_RDWR);
+      struct stat st;
+      if (fd < 0 || ::fstat(fd, &st) < 0)
+      {
+         if (fd >= 0)
+            ::close(fd);
+         throw runtime_error("can't open blob file: " + file_path(file) + ": " + strerror(errno));
+      }
+      files_.insert(file_map::value_type(file, blob_file(fd, st.st_size)));
+      bytes_ += st.st_size;
+   }
+}
+
+blob_store::~blob_store()
+{
+   for (file_map::iterator it = files_.begin(); it != files_.end(); ++it)
+      ::close(it->second.fd);
+}
+
+void blob_store::reserve(id_type chunk, size_type size, id_type& file, size_type& offset)
+{
+   // roll once the last file is full.  a body never spans files, so a file can run over file_size by one body
+   if (files_.empty() || files_.rbegin()->second.size >= file_size_)
+   {
+      int fd = ::open(file_path(chunk).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+         io_error();
+      files_.insert(file_map::value_type(chunk, blob_file(fd, 0)));
+   }
+
+   file_map::reverse_iterator it = files_.rbegin();
+   file = it->first;
+   offset = it->second.size;
+   it->second.size += size;
+   bytes_ += size;
+}
+
+void blob_store::write(id_type file, size_type offset, const string& data)
+{
+   int fd = find(file).fd;
+   const char* buf = data.data();
+   size_t size = data.size();
+   while (size)
+   {
+      ssize_t written = ::pwrite(fd, buf, size, offset);
+      if (written < 0 && errno == EINTR)
+         continue;
+      else if (written <= 0)
+         io_error();
+      buf += written;
+      size -= written;
+      offset += written;
+   }
+}
+
+void blob_store::read(string& result, id_type file, size_type offset, size_type size)
+{
+   int fd = find(file).fd;
+   result.resize(size);
+   size_t pos = 0;
+   while (pos != size)
+   {
+      ssize_t bytes = ::pread(fd, &result[pos], size - pos, offset + pos);
+      if (bytes < 0 && errno == EINTR)
+         continue;
+      else if (bytes <= 0) // a body is never short, so eof means bad data
+         io_error();
+      pos += bytes;
+   }
+}
+
+void blob_store::drop(id_type file, size_type offset, size_type size)
+{
+#ifdef POSIX_FADV_DONTNEED
+   file_map::const_iterator it = files_.find(file);
+   if (it != files_.end())
+      ::posix_fadvise(it->second.fd, offset, size, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void blob_store::sync(id_type file)
+{
+   if (::fdatasync(find(file).fd) < 0)
+      io_error();
+}
+
+int blob_store::fd(id_type file) const
+{
+   return find(file).fd;
+}
+
+void blob_store::release(id_type chunks_low_water)
+{
+   // the last file is still being appended to, so it stays
+   while (files_.size() > 1)
+   {
+      file_map::iterator it = files_.begin(), next = it;
+      ++next;
+      if (next->first > chunks_low_water)
+         break;
+
+      ::close(it->second.fd);
+      if (::unlink(file_path(it->first).c_str()) < 0)
+         log::ERROR("blob_store<%1%>: couldn't unlink %2%: %3%", path_, file_path(it->first), strerror(errno));
+      bytes_ -= it->second.size;
+      files_.erase(it);
+   }
+}
+
+string blob_store::file_path(id_type file) const
+{
+   return (filesystem::path(path_) / (lexical_cast<string>(file) + blob_suffix)).string();
+}
+
+const blob_store::blob_file& blob_store::find(id_type file) const
+{
+   file_map::const_iterator it = files_.find(file);
+   if (it == files_.end()) // released, or never was
+      io_error();
+   return it->second;
+}
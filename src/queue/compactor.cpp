@@ -0,0 +1,124 @@
+#include "darner/queue/compactor.h"
+
+#include <boost/bind.hpp>
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+compactor::compactor(size_t max_running /* = 1 */, size_type rate /* = 0 */)
+: rate_(rate),
+  next_start_(posix_time::microsec_clock::universal_time()),
+  stopping_(false),
+  next_ticket_(0),
+  running_(0),
+  compactions_(0),
+  total_ms_(0),
+  last_ms_(0),
+  bytes_reclaimed_(0),
+  bytes_io_(0)
+{
+   for (size_t i = 0; i < (max_running ? max_running : 1); ++i)
+      workers_.create_thread(bind(&compactor::work, this));
+}
+
+compactor::~compactor()
+{
+   {
+      mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+   }
+   changed_.notify_all();
+   workers_.join_all();
+}
+
+compactor::ticket_type compactor::post(size_type debt, const job_type& job, const done_type& done)
+{
+   pending p;
+   p.job = job;
+   p.done = done;
+   {
+      mutex::scoped_lock lock(mutex_);
+      p.ticket = next_ticket_++;
+      pending_.insert(pending_map::value_type(debt, p));
+   }
+   changed_.notify_one();
+   return p.ticket;
+}
+
+bool compactor::cancel(ticket_type ticket)
+{
+   mutex::scoped_lock lock(mutex_);
+   for (pending_map::iterator it = pending_.begin(); it != pending_.end(); ++it)
+   {
+      if (it->second.ticket == ticket)
+      {
+         pending_.erase(it);
+         return true;
+      }
+   }
+   return false;
+}
+
+void compactor::write_stats(ostringstream& out) const
+{
+   mutex::scoped_lock lock(mutex_);
+   size_type debt = 0;
+   for (pending_map::const_iterator it = pending_.begin(); it != pending_.end(); ++it)
+      debt += it->first;
+   out << "STAT compactions_pending " << pending_.size() << "\r\n";
+   out << "STAT compaction_debt_pending " << debt << "\r\n";
+   out << "STAT compactions_in_flight " << running_ << "\r\n";
+   out << "STAT compactions " << compactions_ << "\r\n";
+   out << "STAT compaction_ms " << total_ms_ << "\r\n";
+   out << "STAT compaction_last_ms " << last_ms_ << "\r\n";
+   out << "STAT compaction_bytes_reclaimed " << bytes_reclaimed_ << "\r\n";
+   out << "STAT compaction_bytes_io " << bytes_io_ << "\r\n";
+}
+
+void compactor::work()
+{
+   mutex::scoped_lock lock(mutex_);
+   for (;;)
+   {
+      if (pending_.empty())
+      {
+         if (stopping_)
+            return;
+         changed_.wait(lock);
+         continue;
+      }
+
+      // when stopping, everything left runs right away.  queues are waiting on it
+      posix_time::ptime now = posix_time::microsec_clock::universal_time();
+      if (rate_ && !stopping_ && now < next_start_)
+      {
+         changed_.timed_wait(lock, next_start_);
+         continue; // there may be more debt at the front now, or a cancel
+      }
+
+      pending p = pending_.begin()->second;
+      pending_.erase(pending_.begin());
+      ++running_;
+
+      lock.unlock();
+      posix_time::ptime start = posix_time::microsec_clock::universal_time();
+      result_type result = p.job();
+      size_type ms = (posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+      lock.lock();
+
+      // charged from when it started, so a compaction that took as long as its share of the rate is already paid for
+      if (rate_)
+         next_start_ = max(start, next_start_) + posix_time::microseconds(result.io * 1000000 / rate_);
+      --running_;
+      ++compactions_;
+      total_ms_ += ms;
+      last_ms_ = ms;
+      bytes_reclaimed_ += result.reclaimed;
+      bytes_io_ += result.io;
+
+      lock.unlock();
+      p.done();
+      lock.lock();
+   }
+}
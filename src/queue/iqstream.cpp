@@ -1,5 +1,7 @@
 #include "darner/queue/iqstream.h"
 
+#include <algorithm>
+
 #include <boost/asio.hpp>
 
 using namespace std;
@@ -17,11 +19,27 @@ bool iqstream::open(shared_ptr<queue> queue)
    if (queue_)
       throw system::system_error(asio::error::already_open); // can't open what's open
 
-   if (!queue->pop_begin(id_))
-      return false;
+   // the item's read in right away, so one that's expired can be erased and the next one tried
+   do
+   {
+      if (!queue->pop_begin(id_))
+         return false;
+
+      header_ = queue::header_type();
+      try
+      {
+         queue->pop_read(item_, header_, id_);
+      }
+      catch (const system::system_error&)
+      {
+         queue->pop_end(false, id_, header_);
+         throw;
+      }
+   } while (queue->pop_expired(id_, header_, item_));
 
    queue_ = queue;
-   header_ = queue::header_type();
+   if (header_.end > 1)
+      item_.clear(); // that was just the header
    chunk_pos_ = header_.beg;
    tell_ = 0;
 
@@ -34,22 +52,36 @@ void iqstream::read(string& result)
    if (!queue_ || chunk_pos_ >= header_.end)
       throw system::system_error(asio::error::eof);
 
-   if (!chunk_pos_) // first read?  check if there's a header
-   {
-      queue_->pop_read(result, header_, id_);
-      if (header_.end > 1)
-         chunk_pos_ = header_.beg;
-      else
-         header_.size = result.size();
-   }
-
-   if (header_.end > 1) // multi-chunk?  get the next chunk!
-      queue_->read_chunk(result, chunk_pos_);
+   if (header_.blob) // in the blob store?  read the next piece of it
+      queue_->read_blob(result, header_, tell_, std::min(piece(), header_.size - tell_));
+   else if (header_.end > 1) // multi-chunk?  get the next chunk!
+      queue_->read_chunk(result, chunk_pos_, header_.end);
+   else // just the one, which open already read
+      result.swap(item_);
 
    ++chunk_pos_;
    tell_ += result.size();
 }
 
+bool iqstream::blob(int& fd, queue::size_type& offset) const
+{
+   if (!queue_ || !header_.blob)
+      return false;
+
+   fd = queue_->blob_fd(header_);
+   offset = header_.offset + tell_;
+   return true;
+}
+
+void iqstream::skip(queue::size_type bytes)
+{
+   if (!queue_ || !header_.blob || bytes > header_.size - tell_)
+      throw system::system_error(asio::error::eof);
+
+   tell_ += bytes;
+   chunk_pos_ = tell_ == header_.size ? header_.end : header_.beg + tell_ / piece();
+}
+
 void iqstream::close(bool erase)
 {
    if (!queue_)
@@ -58,3 +90,18 @@ void iqstream::close(bool erase)
    queue_->pop_end(erase, id_, header_);
    queue_.reset();
 }
+
+queue::size_type iqstream::piece() const
+{
+   return (header_.size + header_.end - header_.beg - 1) / (header_.end - header_.beg);
+}
+
+void iqstream::swap(iqstream& other)
+{
+   queue_.swap(other.queue_);
+   std::swap(id_, other.id_);
+   std::swap(header_, other.header_);
+   item_.swap(other.item_);
+   std::swap(chunk_pos_, other.chunk_pos_);
+   std::swap(tell_, other.tell_);
+}
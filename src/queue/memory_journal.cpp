@@ -0,0 +1,425 @@
+#include "darner/queue/memory_journal.h"
+
+#include <utility>
+
+#include <leveldb/iterator.h>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "darner/util/log.h"
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+namespace {
+
+// keys are copied into the spill journal a batch of about this many bytes at a time
+const memory_journal::size_type spill_batch_size = 4194304;
+
+} // anonymous
+
+// applies a WriteBatch to the keys in memory
+class memory_journal::applier : public leveldb::WriteBatch::Handler
+{
+public:
+
+   applier(memory_journal& journal) : journal_(journal) {}
+
+   void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+   {
+      pair<items_type::iterator, bool> result =
+         journal_.items_.insert(items_type::value_type(key.ToString(), string()));
+      if (result.second)
+         journal_.bytes_ += key.size();
+      else
+         journal_.bytes_ -= result.first->second.size();
+      result.first->second.assign(value.data(), value.size());
+      journal_.bytes_ += value.size();
+   }
+
+   void Delete(const leveldb::Slice& key)
+   {
+      items_type::iterator it = journal_.items_.find(key.ToString());
+      if (it == journal_.items_.end())
+         return;
+      journal_.bytes_ -= it->first.size() + it->second.size();
+      journal_.items_.erase(it);
+   }
+
+private:
+
+   memory_journal& journal_;
+};
+
+// walks the keys.  in memory it remembers the current key and looks it back up on every move, like segment_journal's.
+// while spilled it walks an iterator on the spill journal, which it lets go of if the journal unspills
+class memory_journal::iterator : public leveldb::Iterator
+{
+public:
+
+   iterator(memory_journal& journal) : journal_(journal), valid_(false), loaded_(false)
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      journal_.iterators_.insert(this);
+   }
+
+   ~iterator()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      spilled_.reset();
+      journal_.iterators_.erase(this);
+   }
+
+   bool Valid() const { return valid_; }
+
+   void SeekToFirst()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      if (journal_.spill_)
+      {
+         spilled()->SeekToFirst();
+         load_spilled();
+      }
+      else
+         load(journal_.items_.begin());
+   }
+
+   void SeekToLast()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      if (journal_.spill_)
+      {
+         spilled()->SeekToLast();
+         load_spilled();
+      }
+      else
+      {
+         items_type::iterator it = journal_.items_.end();
+         load(journal_.items_.empty() ? it : --it);
+      }
+   }
+
+   void Seek(const leveldb::Slice& target)
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      if (journal_.spill_)
+      {
+         spilled()->Seek(target);
+         load_spilled();
+      }
+      else
+         load(journal_.items_.lower_bound(target.ToString()));
+   }
+
+   void Next()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      if (journal_.spill_)
+      {
+         leveldb::Iterator* it = spilled_at(key_);
+         if (it->Valid() && it->key() == leveldb::Slice(key_))
+            it->Next();
+         load_spilled();
+      }
+      else
+         load(journal_.items_.upper_bound(key_));
+   }
+
+   void Prev()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      if (journal_.spill_)
+      {
+         leveldb::Iterator* it = spilled_at(key_);
+         if (it->Valid())
+            it->Prev();
+         else
+            it->SeekToLast();
+         load_spilled();
+      }
+      else
+      {
+         items_type::iterator it = journal_.items_.lower_bound(key_);
+         load(it == journal_.items_.begin() ? journal_.items_.end() : --it);
+      }
+   }
+
+   leveldb::Slice key() const { return key_; }
+
+   leveldb::Slice value() const
+   {
+      if (!loaded_)
+      {
+         mutex::scoped_lock lock(journal_.mutex_);
+         items_type::const_iterator it = journal_.items_.find(key_);
+         if (it != journal_.items_.end())
+            value_ = it->second;
+         else if (!journal_.spill_ || !journal_.spill_->Get(leveldb::ReadOptions(), key_, &value_).ok())
+            value_.clear(); // erased since we got here
+         loaded_ = true;
+      }
+      return value_;
+   }
+
+   leveldb::Status status() const { return status_; }
+
+   // the spill journal is closing
+   void unspilled() { spilled_.reset(); }
+
+private:
+
+   void load(items_type::iterator it)
+   {
+      valid_ = it != journal_.items_.end();
+      loaded_ = false; // values are only copied if asked for
+      if (valid_)
+         key_ = it->first;
+   }
+
+   void load_spilled()
+   {
+      valid_ = spilled_->Valid();
+      status_ = spilled_->status();
+      loaded_ = true; // the spill iterator may be gone by the time the value's asked for
+      if (valid_)
+      {
+         key_ = spilled_->key().ToString();
+         value_ = spilled_->value().ToString();
+      }
+   }
+
+   leveldb::Iterator* spilled()
+   {
+      if (!spilled_)
+         spilled_.reset(journal_.spill_->NewIterator(leveldb::ReadOptions()));
+      return spilled_.get();
+   }
+
+   // the spill iterator, at the first key at or after key.  usually it's already there
+   leveldb::Iterator* spilled_at(const string& key)
+   {
+      leveldb::Iterator* it = spilled();
+      if (!it->Valid() || it->key() != leveldb::Slice(key))
+         it->Seek(key);
+      return it;
+   }
+
+   memory_journal& journal_;
+   scoped_ptr<leveldb::Iterator> spilled_;
+
+   bool valid_;
+   string key_;
+   mutable bool loaded_;
+   mutable string value_;
+   mutable leveldb::Status status_;
+};
+
+memory_journal::memory_journal(const leveldb::Comparator* cmp, size_type limit, const string& spill_path,
+   const leveldb::Options* spill_options /* = NULL */)
+: cmp_(cmp),
+  limit_(limit),
+  spill_path_(spill_path),
+  can_spill_(spill_options != NULL),
+  items_(key_less(cmp)),
+  bytes_(0)
+{
+   if (spill_options)
+      spill_options_ = *spill_options;
+   boost::filesystem::remove_all(spill_path_); // left over from before a restart
+}
+
+memory_journal::~memory_journal()
+{
+   mutex::scoped_lock lock(mutex_);
+   close_spill();
+}
+
+leveldb::Status memory_journal::Put(const leveldb::WriteOptions& options, const leveldb::Slice& key,
+   const leveldb::Slice& value)
+{
+   leveldb::WriteBatch batch;
+   batch.Put(key, value);
+   return Write(options, &batch);
+}
+
+leveldb::Status memory_journal::Delete(const leveldb::WriteOptions& options, const leveldb::Slice& key)
+{
+   leveldb::WriteBatch batch;
+   batch.Delete(key);
+   return Write(options, &batch);
+}
+
+leveldb::Status memory_journal::Write(const leveldb::WriteOptions& options, leveldb::WriteBatch* updates)
+{
+   if (!updates)
+      return leveldb::Status::OK();
+
+   mutex::scoped_lock lock(mutex_);
+
+   if (spill_) // nothing here is durable anyway, so the spill journal is never synced
+      return spill_->Write(leveldb::WriteOptions(), updates);
+
+   applier a(*this);
+   leveldb::Status status = updates->Iterate(&a);
+
+   if (status.ok() && can_spill_ && bytes_ > limit_)
+      spill();
+
+   return status;
+}
+
+leveldb::Status memory_journal::Get(const leveldb::ReadOptions& options, const leveldb::Slice& key, string* value)
+{
+   mutex::scoped_lock lock(mutex_);
+
+   if (spill_)
+      return spill_->Get(options, key, value);
+
+   items_type::const_iterator it = items_.find(key.ToString());
+   if (it == items_.end())
+      return leveldb::Status::NotFound(key);
+
+   *value = it->second;
+   return leveldb::Status::OK();
+}
+
+leveldb::Iterator* memory_journal::NewIterator(const leveldb::ReadOptions& options)
+{
+   return new iterator(*this);
+}
+
+bool memory_journal::GetProperty(const leveldb::Slice& property, string* value)
+{
+   mutex::scoped_lock lock(mutex_);
+   return spill_ && spill_->GetProperty(property, value);
+}
+
+void memory_journal::GetApproximateSizes(const leveldb::Range* range, int n, uint64_t* sizes)
+{
+   mutex::scoped_lock lock(mutex_);
+
+   if (spill_)
+      return spill_->GetApproximateSizes(range, n, sizes);
+
+   for (int i = 0; i != n; ++i)
+   {
+      sizes[i] = 0;
+      items_type::const_iterator end = items_.lower_bound(range[i].limit.ToString());
+      for (items_type::const_iterator it = items_.lower_bound(range[i].start.ToString()); it != end; ++it)
+         sizes[i] += it->first.size() + it->second.size();
+   }
+}
+
+void memory_journal::CompactRange(const leveldb::Slice* begin, const leveldb::Slice* end)
+{
+   // a compaction can take a while, so it doesn't hold the lock.  unspill() is never called while one is running
+   leveldb::DB* spill;
+   {
+      mutex::scoped_lock lock(mutex_);
+      spill = spill_.get();
+   }
+   if (spill)
+      spill->CompactRange(begin, end);
+}
+
+bool memory_journal::full(size_type size /* = 0 */) const
+{
+   mutex::scoped_lock lock(mutex_);
+   return !can_spill_ && bytes_ + size > limit_;
+}
+
+memory_journal::size_type memory_journal::bytes() const
+{
+   mutex::scoped_lock lock(mutex_);
+   return bytes_;
+}
+
+bool memory_journal::spilled() const
+{
+   mutex::scoped_lock lock(mutex_);
+   return spill_;
+}
+
+bool memory_journal::unspill()
+{
+   mutex::scoped_lock lock(mutex_);
+
+   if (!spill_)
+      return true;
+
+   items_type items = items_type(key_less(cmp_));
+   size_type bytes = 0;
+   {
+      scoped_ptr<leveldb::Iterator> it(spill_->NewIterator(leveldb::ReadOptions()));
+      for (it->SeekToFirst(); it->Valid(); it->Next())
+      {
+         bytes += it->key().size() + it->value().size();
+         if (bytes > limit_)
+            return false;
+         items.insert(items_type::value_type(it->key().ToString(), it->value().ToString()));
+      }
+      if (!it->status().ok())
+         return false;
+   }
+
+   close_spill();
+   items_.swap(items);
+   bytes_ = bytes;
+   log::INFO("memory_journal<%1%>: back in memory with %2% bytes", spill_path_, bytes_);
+   return true;
+}
+
+// private:
+
+void memory_journal::spill()
+{
+   boost::filesystem::remove_all(spill_path_);
+   leveldb::Options options = spill_options_;
+   options.create_if_missing = true;
+   options.comparator = cmp_;
+   leveldb::DB* pdb;
+   leveldb::Status status = leveldb::DB::Open(options, spill_path_, &pdb);
+   if (!status.ok())
+   {
+      log::ERROR("memory_journal<%1%>: can't spill: %2%", spill_path_, status.ToString());
+      return; // stay in memory, and try again on the next write
+   }
+   spill_.reset(pdb);
+
+   leveldb::WriteBatch batch;
+   size_type batch_bytes = 0;
+   for (items_type::const_iterator it = items_.begin(); it != items_.end() && status.ok(); ++it)
+   {
+      batch.Put(it->first, it->second);
+      batch_bytes += it->first.size() + it->second.size();
+      if (batch_bytes >= spill_batch_size)
+      {
+         status = spill_->Write(leveldb::WriteOptions(), &batch);
+         batch.Clear();
+         batch_bytes = 0;
+      }
+   }
+   if (status.ok())
+      status = spill_->Write(leveldb::WriteOptions(), &batch);
+   if (!status.ok())
+   {
+      log::ERROR("memory_journal<%1%>: can't spill: %2%", spill_path_, status.ToString());
+      close_spill();
+      return;
+   }
+
+   log::INFO("memory_journal<%1%>: spilled %2% bytes to disk", spill_path_, bytes_);
+   items_.clear();
+   bytes_ = 0;
+}
+
+void memory_journal::close_spill()
+{
+   if (!spill_)
+      return;
+   for (set<iterator*>::iterator it = iterators_.begin(); it != iterators_.end(); ++it)
+      (*it)->unspilled();
+   spill_.reset();
+   boost::filesystem::remove_all(spill_path_);
+}
@@ -29,26 +29,48 @@ oqstream::~oqstream()
    }
 }
 
-void oqstream::open(boost::shared_ptr<queue> queue, queue::size_type chunks_count, bool sync)
+void oqstream::open(boost::shared_ptr<queue> queue, queue::size_type chunks_count, bool sync,
+   queue::size_type size, queue::size_type expiration)
 {
    if (queue_) // already open?  that's a paddlin'
       throw system::system_error(asio::error::already_open);
 
+   // reserve first, so that if it throws we aren't left open
+   queue::header_type header;
+   bool rejecting = queue->rejects(size);
+   bool dropping = rejecting || queue->full(size);
+   if (dropping) // nothing's reserved, but the chunks are still counted so the stream closes on time
+      header.end = chunks_count;
+   else if (chunks_count > 1 && queue->use_blob(size))
+      queue->reserve_blob(header, chunks_count, size);
+   else if (chunks_count > 1)
+      queue->reserve_chunks(header, chunks_count);
+   header.expires = queue->expires(expiration);
+
    sync_ = sync;
+   size_ = size;
    queue_ = queue;
-   header_ = queue::header_type();
-   if (chunks_count > 1)
-      queue_->reserve_chunks(header_, chunks_count);
+   header_ = header;
+   rejecting_ = rejecting;
+   dropping_ = dropping;
    chunk_pos_ = header_.beg;
 }
 
-void oqstream::write(const std::string& chunk)
+void oqstream::write(const std::string& chunk, const queue::push_callback& cb)
 {
   if (!queue_ || chunk_pos_ == header_.end)
       throw system::system_error(asio::error::eof);
 
-   if (header_.end <= 1) // just one chunk? push it on
-      queue_->push(id_, chunk, sync_);
+   if (dropping_)
+      ;
+   else if (header_.blob) // going to the blob store?  chunks are appended where it reserved
+   {
+      if (header_.size + chunk.size() > size_) // past the reservation, into the next item's
+         throw system::system_error(asio::error::message_size);
+      queue_->write_blob(chunk, header_, header_.size);
+   }
+   else if (header_.end <= 1) // just one chunk? push it on
+      queue_->push(id_, chunk, sync_, header_.expires, cb);
    else
       queue_->write_chunk(chunk, chunk_pos_);
 
@@ -56,8 +78,17 @@ void oqstream::write(const std::string& chunk)
 
    if (++chunk_pos_ == header_.end) // time to close up shop?
    {
-      if (header_.end > 1) // multi-chunk?  push the header
-         queue_->push(id_, header_, sync_);
+      if (dropping_)
+      {
+         shared_ptr<queue> q;
+         q.swap(queue_); // closed, even though reject and drop throw without a cb
+         if (rejecting_)
+            q->reject(cb);
+         else
+            q->drop(cb);
+      }
+      else if (header_.end > 1) // multi-chunk?  push the header
+         queue_->push(id_, header_, sync_, cb);
       queue_.reset();
    }
 }
@@ -67,7 +98,7 @@ void oqstream::cancel()
    if (!queue_)
       throw system::system_error(asio::error::eof); // not gon' do it
 
-   if (header_.end > 1) // multi-chunk? erase them
+   if (header_.end > 1 && !dropping_) // multi-chunk? erase them
       queue_->erase_chunks(header_);
 
    queue_.reset();
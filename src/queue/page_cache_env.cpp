@@ -0,0 +1,271 @@
+#include "darner/queue/page_cache_env.h"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem/operations.hpp>
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+namespace {
+
+leveldb::Status io_error(const string& context)
+{
+   return leveldb::Status::IOError(context, strerror(errno));
+}
+
+// drops [offset, offset + size) of a file from the page cache, or all of it for a size of 0
+void drop(int fd, off_t offset, off_t size)
+{
+#ifdef POSIX_FADV_DONTNEED
+   ::posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+#endif
+}
+
+// reads a file ahead aggressively
+void sequential(int fd)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+   ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+void keep(bool*) {}
+
+bool yes = true;
+
+// set on leveldb's background thread while it runs one of our jobs, which are all compactions (a memtable written out
+// to a table is one too)
+thread_specific_ptr<bool> compacting(&keep);
+
+} // anonymous
+
+// a file that's read once at startup
+class page_cache_env::sequential_file : public leveldb::SequentialFile
+{
+public:
+
+   sequential_file(leveldb::SequentialFile* file, int fd) : file_(file), fd_(fd) { sequential(fd_); }
+
+   ~sequential_file()
+   {
+      file_.reset();
+      drop(fd_, 0, 0);
+      ::close(fd_);
+   }
+
+   leveldb::Status Read(size_t n, leveldb::Slice* result, char* scratch) { return file_->Read(n, result, scratch); }
+
+   leveldb::Status Skip(uint64_t n) { return file_->Skip(n); }
+
+private:
+
+   scoped_ptr<leveldb::SequentialFile> file_;
+   int fd_;
+};
+
+// a table, read with pread.  it's read ahead once a compaction reads it, since the compaction reads all of it
+class page_cache_env::table_file : public leveldb::RandomAccessFile
+{
+public:
+
+   table_file(const string& fname, int fd) : fname_(fname), fd_(fd), sequential_(false) {}
+
+   ~table_file() { ::close(fd_); }
+
+   leveldb::Status Read(uint64_t offset, size_t n, leveldb::Slice* result, char* scratch) const
+   {
+      ssize_t bytes;
+      do
+         bytes = ::pread(fd_, scratch, n, static_cast<off_t>(offset));
+      while (bytes < 0 && errno == EINTR);
+      *result = leveldb::Slice(scratch, bytes < 0 ? 0 : bytes);
+      if (bytes < 0)
+         return io_error(fname_);
+
+      // leveldb compacts on a single thread, so only that thread ever gets here
+      if (compacting.get() && !sequential_)
+      {
+         sequential(fd_);
+         sequential_ = true;
+      }
+      return leveldb::Status::OK();
+   }
+
+private:
+
+   string fname_;
+   int fd_;
+   mutable bool sequential_;
+};
+
+// a write-ahead log, which nobody reads unless we crash
+class page_cache_env::log_file : public leveldb::WritableFile
+{
+public:
+
+   log_file(leveldb::WritableFile* file, int fd) : file_(file), fd_(fd), size_(0) {}
+
+   ~log_file()
+   {
+      file_.reset();
+      ::close(fd_);
+   }
+
+   leveldb::Status Append(const leveldb::Slice& data)
+   {
+      leveldb::Status status = file_->Append(data);
+      if (status.ok())
+         size_ += data.size();
+      return status;
+   }
+
+   leveldb::Status Close()
+   {
+      leveldb::Status status = file_->Close();
+      drop(fd_, 0, 0); // only clean pages go, so this mostly drops what was synced
+      return status;
+   }
+
+   leveldb::Status Flush() { return file_->Flush(); }
+
+   leveldb::Status Sync()
+   {
+      leveldb::Status status = file_->Sync();
+      if (status.ok()) // synced pages are clean, so they can go
+         drop(fd_, 0, static_cast<off_t>(size_));
+      return status;
+   }
+
+private:
+
+   scoped_ptr<leveldb::WritableFile> file_;
+   int fd_;
+   uint64_t size_;
+};
+
+struct page_cache_env::job
+{
+   job(void (*_function)(void*), void* _arg) : function(_function), arg(_arg) {}
+
+   void (*function)(void*);
+   void* arg;
+};
+
+page_cache_env::page_cache_env(leveldb::Env* target /* = leveldb::Env::Default() */)
+: leveldb::EnvWrapper(target)
+{
+}
+
+leveldb::Status page_cache_env::NewSequentialFile(const string& fname, leveldb::SequentialFile** result)
+{
+   leveldb::Status status = target()->NewSequentialFile(fname, result);
+   if (!status.ok())
+      return status;
+
+   int fd = ::open(fname.c_str(), O_RDONLY);
+   if (fd < 0)
+      return leveldb::Status::OK(); // no hints, then
+
+   *result = new sequential_file(*result, fd);
+   return status;
+}
+
+leveldb::Status page_cache_env::NewRandomAccessFile(const string& fname, leveldb::RandomAccessFile** result)
+{
+   *result = NULL;
+   int fd = ::open(fname.c_str(), O_RDONLY);
+   if (fd < 0)
+      return io_error(fname);
+
+   *result = new table_file(fname, fd);
+   return leveldb::Status::OK();
+}
+
+leveldb::Status page_cache_env::NewWritableFile(const string& fname, leveldb::WritableFile** result)
+{
+   leveldb::Status status = target()->NewWritableFile(fname, result);
+   if (!status.ok() || !algorithm::ends_with(fname, ".log"))
+      return status;
+
+   int fd = ::open(fname.c_str(), O_RDONLY);
+   if (fd < 0)
+      return leveldb::Status::OK();
+
+   *result = new log_file(*result, fd);
+   return status;
+}
+
+leveldb::Status page_cache_env::DeleteFile(const string& fname)
+{
+   // unlinking frees a file's pages only once nobody holds it open, so drop them first.  a compaction's inputs and
+   // retired logs are what leveldb deletes
+   int fd = ::open(fname.c_str(), O_RDONLY);
+   if (fd >= 0)
+   {
+      drop(fd, 0, 0);
+      ::close(fd);
+   }
+   return target()->DeleteFile(fname);
+}
+
+void page_cache_env::Schedule(void (*function)(void* arg), void* arg)
+{
+   target()->Schedule(&page_cache_env::run, new job(function, arg));
+}
+
+page_cache_env::size_type page_cache_env::resident_bytes(const string& path)
+{
+   size_type result = 0;
+   long page_size = ::sysconf(_SC_PAGESIZE);
+   filesystem::directory_iterator end_it;
+   for (filesystem::directory_iterator it(path); it != end_it; ++it)
+   {
+      int fd = ::open(it->path().string().c_str(), O_RDONLY);
+      struct stat st;
+      if (fd < 0)
+         continue;
+      if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size)
+      {
+         ::close(fd);
+         continue;
+      }
+
+      void* map = ::mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (map == MAP_FAILED)
+         continue;
+
+#ifdef __APPLE__
+      vector<char> pages((st.st_size + page_size - 1) / page_size);
+#else
+      vector<unsigned char> pages((st.st_size + page_size - 1) / page_size);
+#endif
+      if (::mincore(map, st.st_size, &pages[0]) == 0)
+      {
+         for (size_t i = 0; i != pages.size(); ++i)
+            result += (pages[i] & 1) ? page_size : 0;
+      }
+      ::munmap(map, st.st_size);
+   }
+   return result;
+}
+
+void page_cache_env::run(void* arg)
+{
+   scoped_ptr<job> j(static_cast<job*>(arg));
+   compacting.reset(&yes);
+   j->function(j->arg);
+   compacting.reset();
+}
@@ -1,66 +1,512 @@
 #include "darner/queue/queue.h"
 
+#include <fstream>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem/operations.hpp>
 
 #include <leveldb/iterator.h>
-#include <leveldb/write_batch.h>
 
+#include "darner/queue/oqstream.h"
+#include "darner/queue/segment_journal.h"
 #include "darner/util/log.h"
 
 using namespace std;
 using namespace boost;
 using namespace darner;
 
-queue::queue(asio::io_service& ios, const string& path)
-: cmp_(new comparator()),
+namespace {
+
+// a migration builds the new journal next to the old one, then swaps them
+const char* const migrating_suffix = ".migrating";
+const char* const unmigrated_suffix = ".unmigrated";
+
+// a closed queue's summary (see queue::summary), so it can be reported without opening the journal
+const char* const summary_file = "SUMMARY";
+
+// every push is stamped with when it was pushed: microseconds since the epoch, native-endian, then \3 \0.  an item
+// that expires has when it expires after that, then \4 \0 instead.  the stamp goes after the rest of the value, so
+// values from before stamps are still read as they were
+const size_t stamp_size = sizeof(boost::uint64_t) + 2;
+const size_t expiring_stamp_size = 2 * sizeof(boost::uint64_t) + 2;
+
+// the size of value's stamp, or 0 if it has none
+size_t stamped(const leveldb::Slice& value)
+{
+   if (value.size() < 2 || value[value.size() - 1] != '\0')
+      return 0;
+   size_t size = value[value.size() - 2] == '\3' ? stamp_size :
+      value[value.size() - 2] == '\4' ? expiring_stamp_size : 0;
+   return value.size() > size ? size : 0;
+}
+
+// expired items are swept this many at a time, so a backlog of them doesn't hold up the event loop
+const size_t sweep_batch = 4096;
+
+// memcache takes an expiration over 30 days as a unix time
+const size_t max_relative_expiration = 2592000;
+
+// finds the value a write batch puts at a key
+class batch_reader : public leveldb::WriteBatch::Handler
+{
+public:
+
+   batch_reader(const leveldb::Slice& key, string& result) : found(false), key_(key), result_(result) {}
+
+   void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+   {
+      if (key == key_)
+      {
+         result_.assign(value.data(), value.size());
+         found = true;
+      }
+   }
+
+   void Delete(const leveldb::Slice& key)
+   {
+      if (key == key_)
+         found = false;
+   }
+
+   bool found;
+
+private:
+
+   leveldb::Slice key_;
+   string& result_;
+};
+
+boost::uint64_t now_us()
+{
+   static const posix_time::ptime epoch(gregorian::date(1970, 1, 1));
+   return (posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+}
+
+} // anonymous
+
+queue::options::options()
+: journal(JT_LEVELDB),
+  segment_size(67108864),
+  memory_limit(67108864),
+  memory_spill(true),
+  sync_window_ms(0),
+  sync_journal(ST_NEVER),
+  sync_every(0),
+  cache_size(1048576),
+  read_ahead(16),
+  compact_bytes(33554432),
+  warm_bytes(0),
+  chunk_size(1024),
+  max_chunk_size(1048576),
+  blob_threshold(1048576),
+  blob_file_size(67108864),
+  max_age_ms(0),
+  sweep_ms(1000),
+  max_items(0),
+  max_bytes(0),
+  discard_old(false),
+  write_buffer_size(4194304),
+  block_size(4096),
+  max_open_files(1000),
+  compression(true),
+  drop_behind(false),
+  block_cache(NULL)
+{
+}
+
+bool queue::options::set(const string& key, const string& value)
+{
+   try
+   {
+      if (key == "journal")
+      {
+         if (value == "leveldb")
+            journal = JT_LEVELDB;
+         else if (value == "segment")
+            journal = JT_SEGMENT;
+         else if (value == "memory")
+            journal = JT_MEMORY;
+         else
+            return false;
+      }
+      else if (key == "segment_size")
+         segment_size = lexical_cast<size_type>(value);
+      else if (key == "memory_limit")
+         memory_limit = lexical_cast<size_type>(value);
+      else if (key == "memory_full")
+      {
+         if (value == "spill")
+            memory_spill = true;
+         else if (value == "drop")
+            memory_spill = false;
+         else
+            return false;
+      }
+      else if (key == "sync_window_ms")
+         sync_window_ms = lexical_cast<size_type>(value);
+      else if (key == "cache_size")
+         cache_size = lexical_cast<size_type>(value);
+      else if (key == "read_ahead")
+         read_ahead = lexical_cast<size_type>(value);
+      else if (key == "compact_bytes")
+         compact_bytes = lexical_cast<size_type>(value);
+      else if (key == "warm_bytes")
+         warm_bytes = lexical_cast<size_type>(value);
+      else if (key == "chunk_size")
+      {
+         chunk_size = lexical_cast<size_type>(value);
+         if (!chunk_size)
+            return false;
+      }
+      else if (key == "max_chunk_size")
+         max_chunk_size = lexical_cast<size_type>(value);
+      else if (key == "blob_threshold")
+         blob_threshold = lexical_cast<size_type>(value);
+      else if (key == "blob_file_size")
+         blob_file_size = lexical_cast<size_type>(value);
+      else if (key == "max_age_ms")
+         max_age_ms = lexical_cast<size_type>(value);
+      else if (key == "expire_to")
+         expire_to = value;
+      else if (key == "sweep_ms")
+      {
+         sweep_ms = lexical_cast<size_type>(value);
+         if (!sweep_ms)
+            return false;
+      }
+      else if (key == "max_items")
+         max_items = lexical_cast<size_type>(value);
+      else if (key == "max_bytes")
+         max_bytes = lexical_cast<size_type>(value);
+      else if (key == "when_full")
+      {
+         if (value == "discard_old")
+            discard_old = true;
+         else if (value == "reject")
+            discard_old = false;
+         else
+            return false;
+      }
+      else if (key == "write_buffer_size")
+         write_buffer_size = lexical_cast<size_type>(value);
+      else if (key == "block_size")
+         block_size = lexical_cast<size_type>(value);
+      else if (key == "max_open_files")
+         max_open_files = lexical_cast<size_type>(value);
+      else if (key == "compression")
+      {
+         if (value == "on")
+            compression = true;
+         else if (value == "off")
+            compression = false;
+         else
+            return false;
+      }
+      else if (key == "drop_behind")
+      {
+         if (value == "on")
+            drop_behind = true;
+         else if (value == "off")
+            drop_behind = false;
+         else
+            return false;
+      }
+      else if (key == "sync_journal")
+      {
+         if (value == "never")
+            sync_journal = ST_NEVER;
+         else if (value == "always")
+            sync_journal = ST_ALWAYS;
+         else if (algorithm::ends_with(value, "items")) // before "ms", which "items" also ends in
+         {
+            sync_journal = ST_ITEMS;
+            sync_every = lexical_cast<size_type>(value.substr(0, value.size() - 5));
+         }
+         else if (algorithm::ends_with(value, "ms"))
+         {
+            sync_journal = ST_MILLISECONDS;
+            sync_every = lexical_cast<size_type>(value.substr(0, value.size() - 2));
+         }
+         else
+            return false;
+
+         if (sync_journal > ST_ALWAYS && !sync_every)
+            return false;
+      }
+      else
+         return false;
+   }
+   catch (const bad_lexical_cast&)
+   {
+      return false;
+   }
+
+   return true;
+}
+
+bool queue::destroyed(const string& path)
+{
+   return boost::filesystem::exists(destroyed_path(path));
+}
+
+string queue::destroyed_path(const string& path)
+{
+   return (boost::filesystem::path(path) / "DESTROYED").string();
+}
+
+void queue::mark_destroyed(const string& path)
+{
+   std::ofstream mark(destroyed_path(path).c_str());
+   if (!mark)
+      throw system::system_error(system::errc::io_error, boost::asio::error::get_system_category());
+}
+
+bool queue::abandoned(const string& path)
+{
+   boost::filesystem::path p(path);
+   string name = boost::filesystem::path(p.filename()).string(); // useless recast for boost backwards compat
+   string::size_type dot = name.rfind('.');
+   if (dot == string::npos || !dot || dot + 1 == name.size() ||
+      name.find_first_not_of("0123456789", dot + 1) != string::npos)
+      return false;
+   if (!boost::filesystem::exists(p.parent_path() / name.substr(0, dot)) || boost::filesystem::exists(p / summary_file))
+      return false;
+
+   // leveldb keeps the comparator's name in the manifest that CURRENT points to
+   std::ifstream current((p / "CURRENT").string().c_str());
+   string manifest;
+   if (!(current >> manifest))
+      return false;
+   std::ifstream in((p / manifest).string().c_str(), std::ios::binary);
+   string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+   return contents.find(legacy_comparator().Name()) != string::npos;
+}
+
+bool queue::migrating(const string& path)
+{
+   return algorithm::ends_with(path, migrating_suffix) || algorithm::ends_with(path, unmigrated_suffix);
+}
+
+bool queue::summary(const string& path, summary_type& result)
+{
+   std::ifstream in((boost::filesystem::path(path) / summary_file).string().c_str());
+   string items_key, bytes_key, pushed_key;
+   return in >> items_key >> result.items >> bytes_key >> result.bytes >> pushed_key >> result.pushed &&
+      items_key == "items" && bytes_key == "bytes" && pushed_key == "pushed";
+}
+
+queue::size_type queue::summary_type::age_ms() const
+{
+   boost::uint64_t now = now_us();
+   return items && pushed && now > pushed ? (now - pushed) / 1000 : 0;
+}
+
+queue::queue(asio::io_service& ios, const string& path, const options& opts, compactor* comp, reaper* reap,
+   warmer* warm)
+: memory_(NULL),
   queue_head_(key_type::KT_QUEUE, 0),
   queue_tail_(key_type::KT_QUEUE, 0),
   chunks_head_(key_type::KT_CHUNK, 0),
   items_open_(0),
   bytes_evicted_(0),
+  compactor_(comp),
+  reaper_(reap),
+  compacting_(false),
+  compact_ticket_(0),
+  compact_debt_(0),
+  low_water_(0),
+  chunks_low_water_(0),
+  marks_dirty_(false),
+  segmented_(false),
+  flush_open_(0),
+  flush_bytes_(0),
+  flush_chunks_(0),
+  open_ms_(0),
+  dropped_(0),
+  expired_items_(0),
+  discarded_(0),
+  rejected_(0),
+  bytes_(0),
+  open_bytes_(0),
+  age_id_(0),
+  age_pushed_(0),
+  queue_reclaimed_(0),
+  chunks_reclaimed_(0),
+  queue_reclaim_to_(0),
+  chunks_reclaim_to_(0),
+  warmer_(warm),
+  warm_posted_(false),
+  warm_ticket_(0),
+  warm_chunk_(0),
+  warm_chunks_end_(0),
+  warm_read_(0),
+  warm_done_(true),
+  sweep_timer_(ios),
+  sweep_armed_(false),
+  sweep_due_(false),
+  cache_(opts.cache_size),
+  group_size_(0),
+  group_erased_(0),
+  group_bytes_(0),
+  commit_scheduled_(false),
+  group_sync_(false),
+  sync_window_timer_(ios),
+  unsynced_items_(0),
+  unsynced_writes_(false),
+  last_sync_(posix_time::microsec_clock::local_time()),
+  sync_timer_(ios),
+  sync_timer_armed_(false),
   destroy_(false),
   wake_up_it_(waiters_.begin()),
   ios_(ios),
-  path_(path)
+  path_(path),
+  options_(opts)
 {
-   leveldb::Options options;
-   options.create_if_missing = true;
-   options.comparator = cmp_.get();
-   leveldb::DB* pdb;
-   if (!leveldb::DB::Open(options, path, &pdb).ok())
-      throw runtime_error("can't open journal: " + path);
-   journal_.reset(pdb);
-   // get head and tail of queue
+   posix_time::ptime start = posix_time::microsec_clock::universal_time();
+   if (options_.drop_behind)
+      env_.reset(new page_cache_env());
+   open_journal(true);
+   boost::filesystem::remove(boost::filesystem::path(path_) / summary_file); // stale as soon as we change anything
+   if (options_.drop_behind)
+   {
+      if (reaper_)
+         page_cache_ = reaper_->count_page_cache(path_);
+      else // there's nowhere to count it in the background, so it's counted the once
+      {
+         shared_ptr<reaper::page_cache_count> counted(new reaper::page_cache_count(path_));
+         counted->update();
+         page_cache_ = counted;
+      }
+   }
+
+   // everything below the low-water marks is erased, and after them is the byte count.  an 8-byte value holds only
+   // the queue mark, as the first version of flush wrote, and a 16-byte one has both marks but no byte count
+   string marks;
+   bool counted = false;
+   if (journal_->Get(leveldb::ReadOptions(), key_type(key_type::KT_META, 0).slice(), &marks).ok())
+   {
+      if (marks.empty() || marks.size() % sizeof(id_type) || marks.size() > 3 * sizeof(id_type))
+         throw runtime_error("bad low-water mark in journal: " + path_);
+      low_water_ = reinterpret_cast<const id_type*>(marks.data())[0];
+      if (marks.size() >= 2 * sizeof(id_type))
+         chunks_low_water_ = reinterpret_cast<const id_type*>(marks.data())[1];
+      if (marks.size() == 3 * sizeof(id_type))
+      {
+         bytes_ = reinterpret_cast<const id_type*>(marks.data())[2];
+         counted = true;
+      }
+   }
+
+   // get head and tail of queue.  the tail is the first live key at or above the mark, so we jump straight past
+   // whatever's below it
    scoped_ptr<leveldb::Iterator> it(journal_->NewIterator(leveldb::ReadOptions()));
    it->Seek(key_type(key_type::KT_QUEUE, 0).slice());
-   if (it->Valid())
+   bool reclaim = it->Valid() && key_type(it->key()).type == key_type::KT_QUEUE &&
+      key_type(it->key()).id < low_water_;
+   it->Seek(key_type(key_type::KT_QUEUE, low_water_).slice());
+   if (it->Valid() && key_type(it->key()).type == key_type::KT_QUEUE)
    {
       queue_tail_ = key_type(it->key());
       it->Seek(key_type(key_type::KT_CHUNK, 0).slice());
       if (!it->Valid())
-      {
          it->SeekToLast();
-         queue_head_.id = key_type(it->key()).id + 1;
-      }
-      else // we have chunks!  so fetch chunks head too
-      {
+      else // we have chunks, or an expiry index!  step back to the last queue key
          it->Prev();
-         queue_head_.id = key_type(it->key()).id + 1;
-         it->SeekToLast();
-         chunks_head_.id = key_type(it->key()).id + 1;
+      queue_head_.id = key_type(it->key()).id + 1;
+   }
+   else
+      queue_tail_.id = queue_head_.id = low_water_;
+   low_water_ = queue_tail_.id; // anything between the mark and the first live key was erased out of order
+
+   it->Seek(key_type(key_type::KT_CHUNK, 0).slice());
+   reclaim = reclaim || (it->Valid() && key_type(it->key()).type == key_type::KT_CHUNK &&
+      key_type(it->key()).id < chunks_low_water_);
+   it->Seek(key_type(key_type::KT_EXPIRY, 0).slice());
+   if (!it->Valid())
+      it->SeekToLast();
+   else // step back past the expiry index to the last chunk
+      it->Prev();
+   if (it->Valid() && key_type(it->key()).type == key_type::KT_CHUNK)
+      chunks_head_.id = std::max(chunks_low_water_, key_type(it->key()).id + 1);
+   else
+      chunks_head_.id = chunks_low_water_;
+   it->Seek(key_type(key_type::KT_CHUNK, chunks_low_water_).slice());
+   chunks_low_water_ = it->Valid() && key_type(it->key()).type == key_type::KT_CHUNK ?
+      key_type(it->key()).id : chunks_head_.id;
+
+   // items that expire from before we stopped are swept once there's a push or pop to start the timer from
+   it->Seek(key_type(key_type::KT_EXPIRY, 0).slice());
+   sweep_due_ = it->Valid();
+   it.reset();
+
+   if (!counted && queue_tail_.id != queue_head_.id) // from before the byte count, so count them this once
+      bytes_ = count_bytes();
+
+   // blob items have a marker chunk, so the chunk mark covers them too
+   blobs_.reset(new blob_store(path_, options_.blob_file_size));
+   release_blobs();
+
+   // keys left below the marks from before we stopped get reclaimed in the background
+   if (reclaim)
+      compact(0);
+
+   // so the first pops after a restart don't all miss
+   if (options_.warm_bytes && queue_tail_.id != queue_head_.id)
+   {
+      warm_done_ = false;
+      warm_it_.reset(journal_->NewIterator(leveldb::ReadOptions()));
+      warm_it_->Seek(queue_tail_.slice());
+      if (warmer_)
+      {
+         warm_ticket_ = warmer_->post(bind(&queue::warm_step, this));
+         warm_posted_ = true;
       }
+      else
+         while (warm_step())
+            ;
    }
+
+   open_ms_ = (posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+   log::INFO("queue<%1%>: opened in %2%ms", path_, open_ms_);
 }
 
 queue::~queue()
 {
+   stop_warming();
+   wait_for_compaction();
+
+   // a group can be left over if we go before its scheduled commit.  its pushes never get an answer, but they and its
+   // erases still make it to the journal
+   if (marks_dirty_ || group_size_)
+      group_.Put(key_type(key_type::KT_META, 0).slice(), marks(group_bytes_));
+   if (group_size_ || group_erased_ || marks_dirty_)
+      journal_->Write(leveldb::WriteOptions(), &group_);
+   // items still open come back when the queue is reopened, unless they were flushed.  a memory journal's don't
+   size_type items = memory_ ? 0 : count() + items_open_ - flush_open_, bytes = memory_ ? 0 : bytes_;
+   boost::uint64_t pushed = items ? oldest_pushed() : 0;
+   cursor_.reset();
    journal_.reset();
-   // TODO: most non-crap filesystems should be able to drop large files quickly, but this will block painfully on ext3.
-   // one ugly solution is a separate delete thread.  or we can wait out everyone upgrading to ext4    :)
+   // most non-crap filesystems should be able to drop large files quickly, but this blocks painfully on ext3.  so
+   // the reaper does it on its own thread
    if (destroy_)
-      boost::filesystem::remove_all(path_);
+   {
+      if (reaper_)
+         reaper_->reap(path_);
+      else
+         boost::filesystem::remove_all(path_);
+   }
+   else
+   {
+      std::ofstream summary((boost::filesystem::path(path_) / summary_file).string().c_str());
+      summary << "items " << items << endl;
+      summary << "bytes " << bytes << endl;
+      summary << "pushed " << pushed << endl;
+   }
 }
 
 void queue::wait(size_type wait_ms, const wait_callback& cb)
@@ -80,67 +526,201 @@ void queue::destroy()
    string new_path = path_ + ".0";
    for (size_t i = 0; boost::filesystem::exists(new_path); ++i)
       new_path = path_ + "." + lexical_cast<string>(i);
+   commit(); // pushes that made it in before the delete still get their answer
+   stop_warming();
+   wait_for_compaction();
+   cursor_.reset();
    journal_.reset();
-   boost::filesystem::rename(path_, new_path);
 
-   leveldb::DB* pdb;
-   leveldb::Options options;
-   options.comparator = cmp_.get();
-   if (!leveldb::DB::Open(options, new_path, &pdb).ok())
-      throw runtime_error("can't open journal: " + path_); // should never happen, but fatal if it does
+   // mark it before the rename, so there's no moment where a crash leaves it looking like a live queue
+   mark_destroyed(path_);
+   boost::filesystem::rename(path_, new_path);
 
-   journal_.reset(pdb);
    path_ = new_path;
+   open_journal(false); // should never fail, but fatal if it does
    destroy_ = true;
 }
 
+void queue::flush()
+{
+   commit(); // pushes that made it in before the flush are flushed too
+
+   low_water_ = queue_head_.id;
+   queue_tail_ = queue_head_;
+   erased_.clear();
+   returned_.clear();
+   expired_.clear();
+   cache_.clear();
+
+   // chunks still being written belong to pushes that come after the flush.  chunks of open items are still being
+   // read, so the chunk mark waits for them to close
+   flush_chunks_ = reserved_.empty() ? chunks_head_.id : std::min(chunks_head_.id, *reserved_.begin());
+   flush_open_ = items_open_;
+   size_type flushed = bytes_ > open_bytes_ ? bytes_ - open_bytes_ : 0;
+   flush_bytes_ = bytes_ = open_bytes_; // open items still count until they're closed
+   if (!flush_open_)
+   {
+      chunks_low_water_ = std::max(chunks_low_water_, flush_chunks_);
+      chunks_erased_.erase_below(chunks_low_water_);
+      advance(chunks_erased_, chunks_low_water_);
+   }
+
+   // the persisted chunk mark includes flush_chunks_ right away.  after a restart nothing is open
+   put(key_type(key_type::KT_META, 0), marks());
+   marks_dirty_ = false;
+   release_blobs();
+
+   compact(flushed); // everything flushed is reclaimed at once, so it's charged as debt
+}
+
 queue::size_type queue::count() const
 {
-   return (queue_head_.id - queue_tail_.id) + returned_.size();
+   return (queue_head_.id - queue_tail_.id) + returned_.size() - expired_.size();
+}
+
+queue::size_type queue::chunk_size(size_type size) const
+{
+   size_type chunk = options_.chunk_size;
+   while (chunk < options_.max_chunk_size && chunk * 16 < size)
+      chunk *= 2;
+   return std::max(options_.chunk_size, std::min(chunk, options_.max_chunk_size));
+}
+
+queue::size_type queue::age_ms() const
+{
+   boost::uint64_t pushed = oldest_pushed(), now = now_us();
+   return pushed && now > pushed ? (now - pushed) / 1000 : 0;
+}
+
+boost::uint64_t queue::oldest_pushed() const
+{
+   if (!count() && !group_size_)
+      return 0;
+
+   id_type oldest = queue_head_.id; // with nothing committed, the oldest item is the first one waiting in the group
+   if (count())
+   {
+      oldest = queue_tail_.id;
+      if (!expired_.empty() && expired_.front() == oldest)
+         oldest = expired_.front_end();
+      if (!returned_.empty())
+         oldest = returned_.front();
+   }
+   if (oldest != age_id_ || !age_pushed_)
+   {
+      age_id_ = oldest;
+      age_pushed_ = 0;
+
+      // where a pop would find it: the cache, then the group waiting to be written, then the journal
+      key_type key(key_type::KT_QUEUE, oldest);
+      string buf;
+      leveldb::Slice value;
+      if (const string* cached = cache_.find(key))
+         value = *cached;
+      else
+      {
+         batch_reader reader(key.slice(), buf);
+         if (oldest >= queue_head_.id)
+            group_.Iterate(&reader);
+         if (reader.found || journal_->Get(leveldb::ReadOptions(), key.slice(), &buf).ok())
+            value = buf;
+      }
+      if (stamped(value))
+         memcpy(&age_pushed_, &value.data()[value.size() - stamped(value)], sizeof(age_pushed_));
+   }
+
+   return age_pushed_;
+}
+
+bool queue::idle() const
+{
+   if (items_open_ || group_size_ || group_erased_ || marks_dirty_ || !waiters_.empty())
+      return false;
+   if (memory_ && (count() || !reserved_.empty())) // closing a memory journal loses what's in it
+      return false;
+   mutex::scoped_lock lock(compact_mutex_);
+   return !compacting_;
 }
 
 void queue::write_stats(const string& name, ostringstream& out) const
 {
    out << "STAT queue_" << name << "_items " << count() << "\r\n";
+   out << "STAT queue_" << name << "_bytes " << bytes_ << "\r\n";
    out << "STAT queue_" << name << "_waiters " << waiters_.size() << "\r\n";
    out << "STAT queue_" << name << "_open_transactions " << items_open_ << "\r\n";
+   out << "STAT queue_" << name << "_open_ms " << open_ms_ << "\r\n";
+   out << "STAT queue_" << name << "_age_ms " << age_ms() << "\r\n";
+   out << "STAT queue_" << name << "_time_in_queue_count " << time_in_queue_.count() << "\r\n";
+   out << "STAT queue_" << name << "_time_in_queue_p50_ms " << time_in_queue_.percentile(0.5) << "\r\n";
+   out << "STAT queue_" << name << "_time_in_queue_p90_ms " << time_in_queue_.percentile(0.9) << "\r\n";
+   out << "STAT queue_" << name << "_time_in_queue_p99_ms " << time_in_queue_.percentile(0.99) << "\r\n";
+   out << "STAT queue_" << name << "_time_in_queue_p999_ms " << time_in_queue_.percentile(0.999) << "\r\n";
+   {
+      mutex::scoped_lock lock(compact_mutex_);
+      out << "STAT queue_" << name << "_compaction_pending " << compacting_ << "\r\n";
+      out << "STAT queue_" << name << "_warming " << !warm_done_ << "\r\n";
+      out << "STAT queue_" << name << "_warm_bytes " << warm_read_ << "\r\n";
+   }
+   out << "STAT queue_" << name << "_compaction_debt " << bytes_evicted_ << "\r\n";
+   out << "STAT queue_" << name << "_returned_runs " << returned_.runs() << "\r\n";
+   out << "STAT queue_" << name << "_cache_hits " << cache_.hits() << "\r\n";
+   out << "STAT queue_" << name << "_cache_misses " << cache_.misses() << "\r\n";
+   out << "STAT queue_" << name << "_cache_bytes " << cache_.bytes() << "\r\n";
+   out << "STAT queue_" << name << "_blob_files " << blobs_->files() << "\r\n";
+   out << "STAT queue_" << name << "_blob_bytes " << blobs_->bytes() << "\r\n";
+   out << "STAT queue_" << name << "_memory_bytes " << (memory_ ? memory_->bytes() : 0) << "\r\n";
+   out << "STAT queue_" << name << "_spilled " << (memory_ && memory_->spilled()) << "\r\n";
+   out << "STAT queue_" << name << "_dropped " << dropped_ << "\r\n";
+   out << "STAT queue_" << name << "_expired " << expired_items_ << "\r\n";
+   out << "STAT queue_" << name << "_discarded " << discarded_ << "\r\n";
+   out << "STAT queue_" << name << "_rejected " << rejected_ << "\r\n";
+   if (page_cache_)
+      out << "STAT queue_" << name << "_page_cache_bytes " << page_cache_->bytes() << "\r\n";
+   out << "STAT queue_" << name << "_since_sync_ms "
+       << (posix_time::microsec_clock::local_time() - last_sync_).total_milliseconds() << "\r\n";
 }
 
 // protected:
 
-void queue::push(id_type& result, const string& item, bool sync)
+void queue::push(id_type& result, const string& item, bool sync, boost::uint64_t expires, const push_callback& cb)
 {
    // items that end in 0 are escaped to (0, 0), so we can distinguish them from headers (which end in (1, 0))
+   string buf;
+   buf.reserve(item.size() + 1 + expiring_stamp_size);
+   buf = item;
    if (item[item.size() - 1] == '\0')
-      put(queue_head_, item + '\0', sync);
-   else
-      put(queue_head_, item, sync);
-
-   result = queue_head_.id++;
-
-   wake_up(); // in case there's a waiter waiting for this new item
+      buf += '\0';
+   stamp(buf, expires);
+   push_value(result, buf, item.size(), expires, sync, cb);
 }
 
-void queue::push(id_type& result, const header_type& header, bool sync)
+void queue::push(id_type& result, const header_type& header, bool sync, const push_callback& cb)
 {
    std::string buf;
 
    header.str(buf);
+   stamp(buf, header.expires);
 
-   put(queue_head_.slice(), buf, sync);
-
-   result = queue_head_.id++;
-
-   wake_up(); // in case there's a waiter waiting for this new item
+   reserved_.erase(reserved_.find(header.beg)); // its chunks are all written
+   if (header.blob && (sync || sync_due())) // the journal's fsync doesn't cover the blob file
+      blobs_->sync(header.file);
+   push_value(result, buf, header.size, header.expires, sync, cb);
 }
 
 bool queue::pop_begin(id_type& result)
 {
-   if (!returned_.empty())
+   if (sweep_due_)
+      arm_sweep();
+
+   // step over whatever the sweep expired at the tail
+   while (!expired_.empty() && expired_.front() == queue_tail_.id)
    {
-      result = *returned_.begin();
-      returned_.erase(returned_.begin());
+      queue_tail_.id = expired_.front_end();
+      expired_.erase_below(queue_tail_.id);
    }
+
+   if (!returned_.empty())
+      result = returned_.pop();
    else if (queue_tail_.id != queue_head_.id)
       result = queue_tail_.id++;
    else
@@ -153,147 +733,1078 @@ bool queue::pop_begin(id_type& result)
 
 void queue::pop_read(std::string& result_item, header_type& result_header, id_type id)
 {
-   get(key_type(key_type::KT_QUEUE, id), result_item);
-
-   result_header = header_type();
+   key_type key(key_type::KT_QUEUE, id);
+   if (!cache_.take(key, result_item))
+      read_ahead(key, queue_head_.id, result_item);
 
-   // check the escapes
-   if (result_item.size() > 2 && result_item[result_item.size() - 1] == '\0')
-   {
-      if (result_item[result_item.size() - 2] == '\1') // \1 \0 means header
-         result_header = header_type(result_item);
-      else if (result_item[result_item.size() - 2] == '\0') // \0 \0 means escaped \0
-         result_item.resize(result_item.size() - 1);
-      else
-         throw system::system_error(system::errc::io_error,
-            boost::asio::error::get_system_category()); // anything else is bad data
-   }
+   decode(result_item, result_header);
+   open_bytes_ += result_header.size;
 }
 
 void queue::pop_end(bool erase, id_type id, const header_type& header)
 {
+   close(id, header);
+
    if (erase)
    {
-      leveldb::WriteBatch batch;
-      batch.Delete(key_type(key_type::KT_QUEUE, id).slice());
-
-      if (header.end > 1) // multi-chunk?
-      {
-         for (key_type k(key_type::KT_CHUNK, header.beg); k.id != header.end; ++k.id)
-            batch.Delete(k.slice());
-      }
-
-      write(batch);
-
-      bytes_evicted_ += header.size;
-
-      // leveldb is conservative about reclaiming deleted keys from its underlying journal.  let's amortize this
-      // reclamation cost by compacting the evicted range when it reaches 32MB in size.  note that this size may be
-      // different than what's on disk, because of snappy compression
-      if (bytes_evicted_ > 33554432)
+      if (header.pushed)
       {
-         compact();
-         bytes_evicted_ = 0;
+         boost::uint64_t now = now_us();
+         time_in_queue_.record(now > header.pushed ? (now - header.pushed) / 1000 : 0);
       }
+      this->erase(id, header);
    }
+   else if (id < low_water_) // flushed while it was open, so it's gone for good
+      bytes_ -= std::min(bytes_, header.size);
    else
    {
       returned_.insert(id);
 
       wake_up(); // in case there's a waiter waiting for this returned key
    }
+}
 
-   --items_open_;
+bool queue::pop_expired(id_type id, const header_type& header, const string& item)
+{
+   if (!header.expires || now_us() < header.expires)
+      return false;
+
+   close(id, header);
+   expire(id, header, item);
+
+   return true;
+}
+
+boost::uint64_t queue::expires(size_type expiration) const
+{
+   boost::uint64_t now = now_us(), result = 0;
+   if (expiration > max_relative_expiration)
+      result = expiration * 1000000;
+   else if (expiration)
+      result = now + expiration * 1000000;
+
+   if (options_.max_age_ms && (!result || now + options_.max_age_ms * 1000 < result))
+      result = now + options_.max_age_ms * 1000;
+   return result;
 }
 
 void queue::reserve_chunks(header_type& result, size_type count)
 {
    result = header_type(chunks_head_.id, chunks_head_.id + count, 0);
+   reserved_.insert(result.beg);
    chunks_head_.id += count;
 }
 
 void queue::write_chunk(const string& chunk, id_type chunk_key)
 {
-   put(key_type(key_type::KT_CHUNK, chunk_key), chunk);
+   key_type key(key_type::KT_CHUNK, chunk_key);
+   put(key, chunk);
+   cache_.put(key, chunk);
 }
 
-void queue::read_chunk(string& result, id_type chunk_key)
+void queue::read_chunk(string& result, id_type chunk_key, id_type chunk_end)
 {
-   get(key_type(key_type::KT_CHUNK, chunk_key), result);
+   key_type key(key_type::KT_CHUNK, chunk_key);
+   if (!cache_.take(key, result))
+      read_ahead(key, chunk_end, result);
 }
 
 void queue::erase_chunks(const header_type& header)
 {
    leveldb::WriteBatch batch;
 
-   for (key_type k(key_type::KT_CHUNK, header.beg); k.id != header.end; ++k.id)
-      batch.Delete(k.slice());
+   reserved_.erase(reserved_.find(header.beg));
+   erase_chunk_range(batch, header.beg, header.end);
+   if (marks_dirty_)
+   {
+      batch.Put(key_type(key_type::KT_META, 0).slice(), marks());
+      marks_dirty_ = false;
+   }
 
    write(batch);
+   release_blobs();
 }
 
-// private:
+void queue::reserve_blob(header_type& result, size_type count, size_type size)
+{
+   reserve_chunks(result, count);
+   result.blob = true;
+   blobs_->reserve(result.beg, size, result.file, result.offset);
 
-void queue::wake_up()
+   // the marker keeps the chunks' ids taken if we restart, and holds the chunk mark below them until they're erased
+   put(key_type(key_type::KT_CHUNK, result.beg), string());
+}
+
+void queue::write_blob(const string& data, const header_type& header, size_type pos)
 {
-   if (wake_up_it_ != waiters_.end())
-   {
-      wake_up_it_->timer.cancel();
-      ++wake_up_it_;
-   }
+   blobs_->write(header.file, header.offset + pos, data);
 }
 
-void queue::waiter_wakeup(const system::error_code& e, ptr_list<queue::waiter>::iterator waiter_it)
+void queue::read_blob(string& result, const header_type& header, size_type pos, size_type size)
 {
-   if (waiter_it == wake_up_it_) // did we time out on the next waiter in line?  too bad.
-      ++wake_up_it_;
+   blobs_->read(result, header.file, header.offset + pos, size);
+}
 
-   ptr_list<waiter>::auto_type waiter = waiters_.release(waiter_it);
+int queue::blob_fd(const header_type& header) const
+{
+   return blobs_->fd(header.file);
+}
 
-   if (!returned_.empty() || queue_tail_.id < queue_head_.id)
-      waiter->cb(system::error_code());
-   else
-      waiter->cb(asio::error::timed_out);
+void queue::drop(const push_callback& cb)
+{
+   ++dropped_;
+   if (!cb)
+      throw system::system_error(asio::error::no_buffer_space);
+   ios_.post(bind(cb, system::error_code(asio::error::no_buffer_space)));
 }
 
-void queue::compact()
+bool queue::rejects(size_type size) const
 {
-   scoped_ptr<leveldb::Iterator> it(journal_->NewIterator(leveldb::ReadOptions()));
+   return !options_.discard_old &&
+      ((options_.max_items && count() + group_size_ + 1 > options_.max_items) ||
+       (options_.max_bytes && bytes_ + group_bytes_ + size > options_.max_bytes));
+}
 
-   // compact queue range first
-   key_type kq_beg(key_type::KT_QUEUE, 0);
-   it->Seek(kq_beg.slice());
-   if (!it->Valid())
+void queue::reject(const push_callback& cb)
+{
+   ++rejected_;
+   if (!cb)
+      throw system::system_error(asio::error::no_buffer_space);
+   ios_.post(bind(cb, system::error_code(asio::error::no_buffer_space)));
+}
+
+// private:
+
+void queue::push_value(id_type& result, const string& value, size_type size, boost::uint64_t expires, bool sync,
+   const push_callback& cb)
+{
+   sync = sync || sync_due();
+   if (!sync)
+      ++unsynced_items_;
+   if (expires || sweep_due_)
+      arm_sweep();
+
+   // pushes with a callback are gathered up for the rest of this turn of the event loop, and written in one batch
+   if (cb)
+   {
+      result = queue_head_.id + group_size_++;
+      key_type key(key_type::KT_QUEUE, result);
+      group_.Put(key.slice(), value);
+      if (expires)
+         group_.Put(expiry_key(expires, result), leveldb::Slice());
+      cache_.put(key, value);
+      group_bytes_ += size;
+      group_sync_ = group_sync_ || sync;
+      if (sync && options_.sync_window_ms)
+         group_synced_callbacks_.push_back(cb);
+      else
+         group_callbacks_.push_back(cb);
+
+      schedule_commit();
       return;
+   }
 
-   key_type kq_end(it->key());
-   --kq_end.id; // leveldb::CompactRange is inclusive [beg, end]
-   leveldb::Slice sq_beg = kq_beg.slice(), sq_end = kq_end.slice();
-   journal_->CompactRange(&sq_beg, &sq_end);
+   commit(); // anything gathered up goes before us
 
-   // now compact chunk range
-   key_type kc_beg(key_type::KT_CHUNK, 0);
-   it->Seek(kc_beg.slice());
-   if (!it->Valid())
-      return log::INFO("queue<%1%>: compacted queue range to %2%", path_, kq_end.id);
+   // the byte count goes in the same write
+   leveldb::WriteBatch batch;
+   batch.Put(queue_head_.slice(), value);
+   if (expires)
+      batch.Put(expiry_key(expires, queue_head_.id), leveldb::Slice());
+   batch.Put(key_type(key_type::KT_META, 0).slice(), marks(size));
+   write(batch, sync);
+   marks_dirty_ = false;
+   bytes_ += size;
+   cache_.put(queue_head_, value);
 
-   key_type kc_end(it->key());
-   --kc_end.id;
-   leveldb::Slice sc_beg = kc_beg.slice(), sc_end = kc_end.slice();
-   journal_->CompactRange(&sc_beg, &sc_end);
-   log::INFO("queue<%1%>: compacted queue range to %2%, chunk range to %3%", path_, kq_end.id, kc_end.id);
+   result = queue_head_.id++;
+
+   wake_up(); // in case there's a waiter waiting for this new item
+
+   discard();
 }
 
-// child classes
-void queue::header_type::str(std::string& out) const
+void queue::erase(id_type id, const header_type& header)
+{
+   key_type key(key_type::KT_QUEUE, id);
+   cache_.erase(key);
+   if (id >= low_water_)
+   {
+      erased_.insert(id);
+      marks_dirty_ = advance(erased_, low_water_) || marks_dirty_;
+      if (id >= low_water_ || segmented_ || memory_) // out of order, so it needs a tombstone until the mark gets here
+         group_.Delete(key.slice());
+   }
+
+   if (header.end > 1) // multi-chunk?
+      erase_chunk_range(group_, header.beg, header.end);
+   if (header.blob && options_.drop_behind) // nobody reads it again
+      blobs_->drop(header.file, header.offset, header.size);
+   if (header.expires)
+      group_.Delete(expiry_key(header.expires, id));
+   bytes_ -= std::min(bytes_, header.size);
+   marks_dirty_ = true; // for the byte count
+
+   ++group_erased_;
+   schedule_commit();
+
+   bytes_evicted_ += header.size;
+
+   // leveldb is conservative about reclaiming deleted keys from its underlying journal.  let's amortize this
+   // reclamation cost by compacting the evicted range when it reaches compact_bytes in size.  note that this size
+   // may be different than what's on disk, because of snappy compression
+   if (bytes_evicted_ > options_.compact_bytes)
+   {
+      commit(); // the deletes have to be in the journal before we compact them away
+      compact(bytes_evicted_);
+      bytes_evicted_ = 0;
+   }
+}
+
+void queue::close(id_type id, const header_type& header)
+{
+   open_bytes_ -= std::min(open_bytes_, header.size);
+   --items_open_;
+
+   if (id < low_water_ && flush_open_) // open at the last flush
+   {
+      flush_bytes_ -= std::min(flush_bytes_, header.size);
+      if (!--flush_open_) // the last one, so its chunks can go
+      {
+         chunks_low_water_ = std::max(chunks_low_water_, flush_chunks_);
+         chunks_erased_.erase_below(chunks_low_water_);
+         advance(chunks_erased_, chunks_low_water_);
+         marks_dirty_ = true;
+         schedule_commit();
+      }
+   }
+}
+
+void queue::expire(id_type id, const header_type& header, const string& item)
+{
+   shared_ptr<queue> target;
+   if (expire_to_ && (header.end > 1 || !item.empty()))
+      target = expire_to_();
+
+   if (target && target.get() != this)
+   {
+      // it's read in whole, then pushed in the target's chunks
+      try
+      {
+         string value = item, chunk;
+         if (header.blob)
+            read_blob(value, header, 0, header.size);
+         else if (header.end > 1)
+         {
+            value.clear();
+            for (id_type k = header.beg; k != header.end; ++k)
+            {
+               read_chunk(chunk, k, header.end);
+               value += chunk;
+            }
+         }
+
+         oqstream out;
+         size_type chunk_size = target->chunk_size(value.size());
+         out.open(target, (value.size() + chunk_size - 1) / chunk_size, false, value.size());
+         for (size_type pos = 0; pos < value.size(); pos += chunk_size)
+            out.write(value.substr(pos, chunk_size));
+      }
+      catch (const system::system_error& ex)
+      {
+         log::ERROR("queue<%1%>: couldn't move an expired item to %2%: %3%", path_, options_.expire_to,
+            ex.code().message());
+      }
+   }
+
+   erase(id, header);
+   ++expired_items_;
+}
+
+string queue::expiry_key(boost::uint64_t expires, id_type id)
+{
+   string key(1 + 2 * sizeof(id_type), static_cast<char>(key_type::KT_EXPIRY));
+   for (size_t i = 0; i != sizeof(id_type); ++i)
+   {
+      key[sizeof(id_type) - i] = static_cast<char>(expires >> (8 * i));
+      key[2 * sizeof(id_type) - i] = static_cast<char>(id >> (8 * i));
+   }
+   return key;
+}
+
+void queue::expiry_key(const leveldb::Slice& key, boost::uint64_t& expires, id_type& id)
+{
+   expires = id = 0;
+   for (size_t i = 1; i <= sizeof(id_type) && i + sizeof(id_type) < key.size(); ++i)
+   {
+      expires = (expires << 8) | static_cast<unsigned char>(key[i]);
+      id = (id << 8) | static_cast<unsigned char>(key[i + sizeof(id_type)]);
+   }
+}
+
+void queue::arm_sweep()
+{
+   sweep_due_ = false;
+   if (sweep_armed_)
+      return;
+   sweep_armed_ = true;
+   sweep_timer_.expires_from_now(posix_time::milliseconds(options_.sweep_ms));
+   sweep_timer_.async_wait(
+      bind(&queue::sweep_timeout, weak_ptr<queue>(shared_from_this()), asio::placeholders::error));
+}
+
+void queue::sweep_timeout(const weak_ptr<queue>& self, const system::error_code& e)
+{
+   shared_ptr<queue> q = self.lock();
+   if (!q)
+      return;
+
+   q->sweep_armed_ = false;
+   if (e)
+      return;
+
+   try
+   {
+      q->sweep();
+   }
+   catch (const system::system_error& ex)
+   {
+      log::ERROR("queue<%1%>: expiry sweep failed: %2%", q->path_, ex.code().message());
+   }
+}
+
+void queue::sweep()
+{
+   boost::uint64_t now = now_us(), expires;
+   id_type id;
+   size_t swept = 0;
+   bool more = false;
+
+   scoped_ptr<leveldb::Iterator> it(journal_->NewIterator(leveldb::ReadOptions()));
+   for (it->Seek(key_type(key_type::KT_EXPIRY, 0).slice()); it->Valid(); it->Next())
+   {
+      expiry_key(it->key(), expires, id);
+      more = expires > now || swept == sweep_batch;
+      if (more)
+         break;
+      ++swept;
+
+      // an item that's open is expired when it's closed, and one that's gone just leaves its key behind
+      group_.Delete(it->key());
+      ++group_erased_;
+      if (returned_.contains(id))
+         returned_.erase(id);
+      else if (id >= queue_tail_.id && id < queue_head_.id && !expired_.contains(id))
+         expired_.insert(id);
+      else
+         continue;
+
+      string value;
+      header_type header;
+      if (journal_->Get(leveldb::ReadOptions(), key_type(key_type::KT_QUEUE, id).slice(), &value).ok())
+         decode(value, header);
+      else
+         value.clear();
+      header.expires = 0; // its key's already going
+      expire(id, header, value);
+   }
+   if (!it->status().ok())
+      log::ERROR("queue<%1%>: couldn't read the expiry index", path_);
+   it.reset();
+
+   commit();
+
+   if (swept == sweep_batch) // there's a backlog, so keep at it
+   {
+      sweep_armed_ = true;
+      ios_.post(bind(&queue::sweep_timeout, weak_ptr<queue>(shared_from_this()), system::error_code()));
+   }
+   else if (more)
+      arm_sweep();
+}
+
+void queue::discard()
+{
+   if (!options_.discard_old)
+      return;
+
+   // popped and erased like any other item, they all go in the next commit
+   id_type id;
+   while (((options_.max_items && count() > options_.max_items) || (options_.max_bytes && bytes_ > options_.max_bytes))
+      && pop_begin(id))
+   {
+      string value;
+      header_type header;
+      try
+      {
+         pop_read(value, header, id);
+      }
+      catch (const system::system_error& ex)
+      {
+         log::ERROR("queue<%1%>: couldn't discard an item: %2%", path_, ex.code().message());
+         pop_end(false, id, header);
+         return;
+      }
+      close(id, header);
+      erase(id, header);
+      ++discarded_;
+   }
+}
+
+void queue::schedule_commit()
+{
+   if (commit_scheduled_)
+      return;
+   commit_scheduled_ = true;
+   ios_.post(bind(&queue::scheduled_commit, weak_ptr<queue>(shared_from_this())));
+}
+
+void queue::scheduled_commit(const weak_ptr<queue>& self)
+{
+   if (shared_ptr<queue> q = self.lock())
+   {
+      q->commit_scheduled_ = false;
+      q->commit();
+   }
+}
+
+void queue::commit()
+{
+   if (!group_size_ && !group_erased_ && !marks_dirty_)
+      return; // nothing waiting, or someone already committed for us
+
+   vector<push_callback> callbacks, synced_callbacks;
+   callbacks.swap(group_callbacks_);
+   synced_callbacks.swap(group_synced_callbacks_);
+
+   // the marks and the byte count go in the same batch as the pushes and erases that moved them
+   if (marks_dirty_ || group_size_)
+      group_.Put(key_type(key_type::KT_META, 0).slice(), marks(group_bytes_));
+
+   system::error_code error;
+   try
+   {
+      // with a sync window, the batch goes in unsynced now, and its synced pushes wait for the window's fsync
+      write(group_, group_sync_ && !options_.sync_window_ms);
+      marks_dirty_ = false;
+      release_blobs(); // the chunk mark that frees them is in the journal now
+      bytes_ += group_bytes_;
+      unspill();
+      queue_head_.id += group_size_;
+      for (size_type i = 0; i != group_size_; ++i)
+         wake_up(); // in case there's a waiter waiting for this new item
+   }
+   catch (const system::system_error& ex)
+   {
+      // HEAD hasn't moved, so the next pushes will reuse these keys.  erased items are already gone from the queue,
+      // they'll only come back if we restart before they're erased again
+      error = ex.code();
+      for (key_type k(key_type::KT_QUEUE, queue_head_.id); k.id != queue_head_.id + group_size_; ++k.id)
+         cache_.erase(k);
+   }
+
+   group_.Clear();
+   group_size_ = 0;
+   group_erased_ = 0;
+   group_bytes_ = 0;
+   group_sync_ = false;
+
+   if (!error)
+      discard(); // its erases go in the next commit
+
+   if (!error && !synced_callbacks.empty())
+   {
+      if (sync_window_callbacks_.empty()) // first one in opens the window
+      {
+         sync_window_timer_.expires_from_now(posix_time::milliseconds(options_.sync_window_ms));
+         sync_window_timer_.async_wait(
+            bind(&queue::sync_window_timeout, shared_from_this(), asio::placeholders::error));
+      }
+      sync_window_callbacks_.insert(sync_window_callbacks_.end(), synced_callbacks.begin(), synced_callbacks.end());
+   }
+   else
+      callbacks.insert(callbacks.end(), synced_callbacks.begin(), synced_callbacks.end());
+
+   for (vector<push_callback>::iterator it = callbacks.begin(); it != callbacks.end(); ++it)
+      (*it)(error);
+}
+
+void queue::sync_window_timeout(const system::error_code& e)
+{
+   vector<push_callback> callbacks;
+   callbacks.swap(sync_window_callbacks_);
+
+   system::error_code error = e;
+   if (!error)
+   {
+      try
+      {
+         sync_journal();
+      }
+      catch (const system::system_error& ex)
+      {
+         error = ex.code();
+      }
+   }
+
+   for (vector<push_callback>::iterator it = callbacks.begin(); it != callbacks.end(); ++it)
+      (*it)(error);
+}
+
+bool queue::sync_due() const
+{
+   return options_.sync_journal == options::ST_ALWAYS ||
+      (options_.sync_journal == options::ST_ITEMS && unsynced_items_ + 1 >= options_.sync_every);
+}
+
+void queue::sync_journal()
+{
+   leveldb::WriteBatch batch; // an empty synced write fsyncs everything before it
+   write(batch, true);
+}
+
+void queue::sync_timeout(const system::error_code& e)
+{
+   sync_timer_armed_ = false;
+
+   if (e || !unsynced_writes_)
+      return;
+
+   try
+   {
+      sync_journal();
+   }
+   catch (const system::system_error& ex)
+   {
+      log::ERROR("queue<%1%>: periodic sync failed: %2%", path_, ex.code().message());
+   }
+}
+
+void queue::wrote(bool synced)
+{
+   if (synced)
+   {
+      unsynced_items_ = 0;
+      unsynced_writes_ = false;
+      last_sync_ = posix_time::microsec_clock::local_time();
+      return;
+   }
+
+   unsynced_writes_ = true;
+
+   if (options_.sync_journal == options::ST_MILLISECONDS && !sync_timer_armed_)
+   {
+      sync_timer_armed_ = true;
+      sync_timer_.expires_from_now(posix_time::milliseconds(options_.sync_every));
+      sync_timer_.async_wait(bind(&queue::sync_timeout, shared_from_this(), asio::placeholders::error));
+   }
+}
+
+void queue::wake_up()
+{
+   if (wake_up_it_ != waiters_.end())
+   {
+      wake_up_it_->timer.cancel();
+      ++wake_up_it_;
+   }
+}
+
+void queue::waiter_wakeup(const system::error_code& e, ptr_list<queue::waiter>::iterator waiter_it)
+{
+   if (waiter_it == wake_up_it_) // did we time out on the next waiter in line?  too bad.
+      ++wake_up_it_;
+
+   ptr_list<waiter>::auto_type waiter = waiters_.release(waiter_it);
+
+   if (count())
+      waiter->cb(system::error_code());
+   else
+      waiter->cb(asio::error::timed_out);
+}
+
+void queue::open_journal(bool create_if_missing)
+{
+   // finish a migration that was cut short.  the new journal is complete before the old one is moved aside
+   string migrating_path = path_ + migrating_suffix, unmigrated_path = path_ + unmigrated_suffix;
+   if (boost::filesystem::exists(unmigrated_path))
+   {
+      if (!boost::filesystem::exists(path_))
+         boost::filesystem::rename(migrating_path, path_);
+      boost::filesystem::remove_all(unmigrated_path);
+   }
+   boost::filesystem::remove_all(migrating_path);
+
+   // leveldb journals always have a CURRENT file
+   bool is_leveldb = boost::filesystem::exists(boost::filesystem::path(path_) / "CURRENT");
+   segmented_ = !is_leveldb && (segment_journal::exists(path_) || options_.journal == options::JT_SEGMENT);
+
+   // there's nothing on disk to say a queue is in memory, so a queue is only kept in memory if it has no journal
+   memory_ = NULL;
+   if (!is_leveldb && !segmented_ && options_.journal == options::JT_MEMORY)
+   {
+      boost::filesystem::create_directories(path_); // for the summary, and the spill journal
+      leveldb::Options spill_options = leveldb_options(leveldb::BytewiseComparator(), true);
+      memory_ = new memory_journal(leveldb::BytewiseComparator(), options_.memory_limit,
+         (boost::filesystem::path(path_) / "spill").string(), options_.memory_spill ? &spill_options : NULL);
+      journal_.reset(memory_);
+      return;
+   }
+
+   leveldb::DB* pdb;
+   leveldb::Status status = open_journal(path_, leveldb::BytewiseComparator(), create_if_missing, &pdb);
+   if (!status.ok() && (is_leveldb || segment_journal::exists(path_)))
+   {
+      // maybe it's in the old format
+      legacy_comparator cmp;
+      if (open_journal(path_, &cmp, false, &pdb).ok())
+      {
+         scoped_ptr<leveldb::DB> legacy(pdb);
+         migrate(legacy);
+         status = open_journal(path_, leveldb::BytewiseComparator(), false, &pdb);
+      }
+   }
+
+   if (!status.ok())
+      throw runtime_error("can't open journal: " + path_ + ": " + status.ToString());
+
+   journal_.reset(pdb);
+}
+
+leveldb::Status queue::open_journal(const string& path, const leveldb::Comparator* cmp, bool create_if_missing,
+   leveldb::DB** result)
+{
+   if (segmented_)
+      return segment_journal::open(cmp, path, options_.segment_size, create_if_missing, result);
+
+   return leveldb::DB::Open(leveldb_options(cmp, create_if_missing), path, result);
+}
+
+leveldb::Options queue::leveldb_options(const leveldb::Comparator* cmp, bool create_if_missing) const
+{
+   leveldb::Options options;
+   options.create_if_missing = create_if_missing;
+   options.comparator = cmp;
+   options.write_buffer_size = options_.write_buffer_size;
+   options.block_size = options_.block_size;
+   options.max_open_files = static_cast<int>(options_.max_open_files);
+   options.compression = options_.compression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+   options.block_cache = options_.block_cache;
+   if (env_)
+      options.env = env_.get();
+   return options;
+}
+
+void queue::unspill()
+{
+   if (!memory_ || count() || items_open_ || !reserved_.empty() || !memory_->spilled())
+      return;
+
+   mutex::scoped_lock lock(compact_mutex_);
+   if (!compacting_) // a compaction could be using the spill journal.  we'll get another chance at the next commit
+      memory_->unspill();
+}
+
+void queue::migrate(scoped_ptr<leveldb::DB>& legacy)
+{
+   string migrating_path = path_ + migrating_suffix, unmigrated_path = path_ + unmigrated_suffix;
+
+   leveldb::DB* pdb;
+   leveldb::Status status = open_journal(migrating_path, leveldb::BytewiseComparator(), true, &pdb);
+   if (!status.ok())
+      throw runtime_error("can't migrate journal: " + path_ + ": " + status.ToString());
+
+   size_type keys = 0;
+   {
+      scoped_ptr<leveldb::DB> migrated(pdb);
+      scoped_ptr<leveldb::Iterator> it(legacy->NewIterator(leveldb::ReadOptions()));
+      leveldb::WriteBatch batch;
+      size_type puts = 0;
+      for (it->SeekToFirst(); it->Valid(); it->Next(), ++keys)
+      {
+         batch.Put(key_type::legacy(it->key()).slice(), it->value());
+         if (++puts >= 1024)
+         {
+            status = migrated->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+               break;
+            batch.Clear();
+            puts = 0;
+         }
+      }
+      if (!it->status().ok())
+         status = it->status();
+
+      // the last batch is synced, so the new journal is all on disk before we move the old one aside
+      leveldb::WriteOptions write_options;
+      write_options.sync = true;
+      if (status.ok())
+         status = migrated->Write(write_options, &batch);
+      if (!status.ok())
+         throw runtime_error("can't migrate journal: " + path_ + ": " + status.ToString());
+   }
+   legacy.reset();
+
+   boost::filesystem::rename(path_, unmigrated_path);
+   boost::filesystem::rename(migrating_path, path_);
+   boost::filesystem::remove_all(unmigrated_path);
+
+   log::INFO("queue<%1%>: migrated %2% keys to the bytewise journal format", path_, keys);
+}
+
+void queue::read_ahead(const key_type& key, id_type end, string& result)
+{
+   if (!options_.read_ahead || !options_.cache_size)
+      return get(key, result);
+
+   if (!cursor_)
+      cursor_.reset(journal_->NewIterator(leveldb::ReadOptions()));
+
+   if (!cursor_->Valid() || cursor_->key() != key.slice())
+   {
+      cursor_->Seek(key.slice());
+      if (!cursor_->Valid() || cursor_->key() != key.slice())
+      {
+         // key is newer than the cursor's view of the journal
+         cursor_.reset(journal_->NewIterator(leveldb::ReadOptions()));
+         cursor_->Seek(key.slice());
+         if (!cursor_->Valid() || cursor_->key() != key.slice())
+            throw system::system_error(system::errc::io_error, boost::asio::error::get_system_category());
+      }
+   }
+
+   result = cursor_->value().ToString();
+
+   // stop at half the cache, so what we read ahead doesn't push itself out
+   size_type bytes = 0;
+   cursor_->Next();
+   for (size_type i = 0; i != options_.read_ahead && cursor_->Valid(); ++i, cursor_->Next())
+   {
+      key_type k(cursor_->key());
+      if (k.type != key.type || k.id >= end || bytes + cursor_->value().size() > options_.cache_size / 2)
+         break;
+      if (k.type == key_type::KT_QUEUE && (k.id < queue_tail_.id || expired_.contains(k.id)))
+         continue; // already popped by someone else, or swept
+      cache_.put(k, cursor_->value().ToString());
+      bytes += cursor_->value().size();
+   }
+
+   if (!cursor_->status().ok())
+      throw system::system_error(system::errc::io_error, boost::asio::error::get_system_category());
+}
+
+void queue::erase_chunk_range(leveldb::WriteBatch& batch, id_type beg, id_type end)
+{
+   for (key_type k(key_type::KT_CHUNK, beg); k.id != end; ++k.id)
+      cache_.erase(k);
+
+   beg = std::max(beg, chunks_low_water_);
+   if (beg >= end)
+      return; // flushed while it was open
+
+   chunks_erased_.insert(beg, end);
+   marks_dirty_ = advance(chunks_erased_, chunks_low_water_) || marks_dirty_;
+   id_type from = segmented_ || memory_ ? beg : std::max(beg, chunks_low_water_);
+   for (key_type k(key_type::KT_CHUNK, from); k.id < end; ++k.id)
+      batch.Delete(k.slice()); // out of order, so it needs a tombstone until the mark gets here
+}
+
+bool queue::advance(id_set& erased, id_type& mark)
+{
+   id_type before = mark;
+   while (!erased.empty() && erased.front() == mark)
+   {
+      mark = erased.front_end();
+      erased.erase_below(mark);
+   }
+   return mark != before;
+}
+
+string queue::marks(size_type pushing /* = 0 */) const
+{
+   // a flush's chunk mark is safe to persist before it's applied, since nothing is open after a restart.  for the same
+   // reason, neither are the bytes of items open at the flush
+   id_type marks[3] = { low_water_, std::max(chunks_low_water_, flush_chunks_), bytes_ + pushing - flush_bytes_ };
+   return string(reinterpret_cast<const char*>(marks), sizeof(marks));
+}
+
+queue::size_type queue::count_bytes()
+{
+   size_type bytes = 0;
+   string value;
+   header_type header;
+   scoped_ptr<leveldb::Iterator> it(journal_->NewIterator(leveldb::ReadOptions()));
+   for (it->Seek(queue_tail_.slice()); it->Valid() && key_type(it->key()).type == key_type::KT_QUEUE; it->Next())
+   {
+      value = it->value().ToString();
+      decode(value, header);
+      bytes += header.size;
+   }
+   log::INFO("queue<%1%>: counted %2% bytes of items", path_, bytes);
+   return bytes;
+}
+
+void queue::release_blobs()
+{
+   if (!destroy_) // a destroyed journal's files all go together
+      blobs_->release(chunks_low_water_);
+}
+
+void queue::compact(size_type debt)
+{
+   cursor_.reset(); // let go of what compaction frees
+
+   {
+      mutex::scoped_lock lock(compact_mutex_);
+      queue_reclaim_to_ = low_water_;
+      chunks_reclaim_to_ = chunks_low_water_;
+      compact_debt_ += debt;
+   }
+
+   if (!compactor_)
+   {
+      compact_journal();
+      mutex::scoped_lock lock(compact_mutex_);
+      compact_debt_ = 0;
+      return;
+   }
+
+   mutex::scoped_lock lock(compact_mutex_);
+   if (compacting_)
+      return; // compaction_done picks up the new marks, and the debt
+   compacting_ = true;
+   compact_ticket_ = compactor_->post(compact_debt_, bind(&queue::compact_journal, this),
+      bind(&queue::compaction_done, this));
+   compact_debt_ = 0;
+}
+
+compactor::result_type queue::compact_journal()
+{
+   id_type queue_from, queue_to, chunks_from, chunks_to;
+   {
+      mutex::scoped_lock lock(compact_mutex_);
+      queue_from = queue_reclaimed_;
+      queue_to = queue_reclaim_to_;
+      chunks_from = chunks_reclaimed_;
+      chunks_to = chunks_reclaim_to_;
+   }
+
+   compactor::result_type queue_result = reclaim(key_type::KT_QUEUE, queue_from, queue_to),
+      chunks_result = reclaim(key_type::KT_CHUNK, chunks_from, chunks_to);
+
+   mutex::scoped_lock lock(compact_mutex_);
+   queue_reclaimed_ = queue_to;
+   chunks_reclaimed_ = chunks_to;
+   return compactor::result_type(queue_result.reclaimed + chunks_result.reclaimed, queue_result.io + chunks_result.io);
+}
+
+compactor::result_type queue::reclaim(unsigned char type, id_type from, id_type to)
+{
+   if (from >= to)
+      return compactor::result_type();
+
+   // keys below a mark have no tombstones, so delete them now.  there's nothing live in the range to step around
+   leveldb::WriteBatch batch;
+   size_type deletes = 0;
+   scoped_ptr<leveldb::Iterator> it(journal_->NewIterator(leveldb::ReadOptions()));
+   for (it->Seek(key_type(type, from).slice()); it->Valid(); it->Next())
+   {
+      key_type k(it->key());
+      if (k.type != type || k.id >= to)
+         break;
+      batch.Delete(it->key());
+      if (++deletes >= 1024)
+      {
+         if (!journal_->Write(leveldb::WriteOptions(), &batch).ok())
+            break;
+         batch.Clear();
+         deletes = 0;
+      }
+   }
+   it.reset();
+   if (deletes && !journal_->Write(leveldb::WriteOptions(), &batch).ok())
+      log::ERROR("queue<%1%>: couldn't reclaim keys below the low-water mark", path_);
+
+   key_type beg(type, from), end(type, to - 1); // leveldb::CompactRange is inclusive [beg, end]
+   string beg_key = beg.slice().ToString(), end_key = end.slice().ToString();
+   leveldb::Range range(beg_key, end_key);
+   uint64_t before, after;
+   journal_->GetApproximateSizes(&range, 1, &before);
+   journal_->CompactRange(&range.start, &range.limit);
+   journal_->GetApproximateSizes(&range, 1, &after);
+
+   log::INFO("queue<%1%>: compacted %2% range to %3%", path_, type == key_type::KT_QUEUE ? "queue" : "chunk", to);
+
+   // the range is read through, and what's left of it written back out
+   return compactor::result_type(before > after ? before - after : 0, before + after);
+}
+
+void queue::compaction_done()
+{
+   mutex::scoped_lock lock(compact_mutex_);
+   if (queue_reclaimed_ < queue_reclaim_to_ || chunks_reclaimed_ < chunks_reclaim_to_) // marks moved while we were busy
+   {
+      compact_ticket_ = compactor_->post(compact_debt_, bind(&queue::compact_journal, this),
+         bind(&queue::compaction_done, this));
+      compact_debt_ = 0;
+      return;
+   }
+   compacting_ = false;
+   compacted_.notify_all();
+}
+
+void queue::wait_for_compaction()
+{
+   mutex::scoped_lock lock(compact_mutex_);
+   if (compacting_ && compactor_->cancel(compact_ticket_))
+      compacting_ = false; // it never started
+   while (compacting_)
+      compacted_.wait(lock);
+}
+
+queue::size_type queue::warm_step()
+{
+   const size_type step_bytes = 65536;
+
+   size_type bytes = 0, read;
+   {
+      mutex::scoped_lock lock(compact_mutex_);
+      read = warm_read_;
+   }
+   while (bytes < step_bytes && read + bytes < options_.warm_bytes)
+   {
+      if (warm_chunk_ != warm_chunks_end_) // the chunks of the last item first
+      {
+         string chunk;
+         if (journal_->Get(leveldb::ReadOptions(), key_type(key_type::KT_CHUNK, warm_chunk_++).slice(), &chunk).ok())
+            bytes += chunk.size();
+         continue;
+      }
+
+      if (!warm_it_->Valid() || key_type(warm_it_->key()).type != key_type::KT_QUEUE)
+         break;
+      leveldb::Slice value = warm_it_->value();
+      bytes += value.size();
+      value = leveldb::Slice(value.data(), value.size() - stamped(value));
+      if (value.size() > 2 && value[value.size() - 1] == '\0' && value[value.size() - 2] == '\1') // chunk header
+      {
+         header_type header(value.ToString());
+         warm_chunk_ = header.beg;
+         warm_chunks_end_ = header.end;
+      }
+      warm_it_->Next();
+   }
+
+   if (!bytes)
+      warm_it_.reset(); // let go of the journal version it pins
+
+   mutex::scoped_lock lock(compact_mutex_);
+   warm_read_ += bytes;
+   warm_done_ = !bytes;
+   return bytes;
+}
+
+void queue::stop_warming()
+{
+   if (warm_posted_)
+      warmer_->cancel(warm_ticket_);
+   warm_posted_ = false;
+   warm_it_.reset();
+
+   mutex::scoped_lock lock(compact_mutex_);
+   warm_done_ = true;
+}
+
+// child classes
+queue::header_type::header_type(const std::string& buf)
+: blob(buf[buf.size() - 2] == '\2'),
+  file(0),
+  offset(0),
+  pushed(0),
+  expires(0)
+{
+   const id_type* fields = reinterpret_cast<const id_type*>(buf.data());
+   beg = fields[0];
+   end = fields[1];
+   size = fields[2];
+   if (blob)
+   {
+      file = fields[3];
+      offset = fields[4];
+   }
+}
+
+void queue::stamp(string& value, boost::uint64_t expires)
+{
+   boost::uint64_t pushed = now_us();
+   value.append(reinterpret_cast<const char*>(&pushed), sizeof(pushed));
+   if (expires)
+      value.append(reinterpret_cast<const char*>(&expires), sizeof(expires));
+   value += expires ? '\4' : '\3';
+   value += '\0';
+}
+
+void queue::decode(string& value, header_type& header)
+{
+   header = header_type();
+
+   boost::uint64_t pushed = 0, expires = 0;
+   if (size_t size = stamped(value))
+   {
+      memcpy(&pushed, &value[value.size() - size], sizeof(pushed));
+      if (size == expiring_stamp_size)
+         memcpy(&expires, &value[value.size() - size + sizeof(pushed)], sizeof(expires));
+      value.resize(value.size() - size);
+   }
+   header.pushed = pushed;
+   header.expires = expires;
+
+   // check the escapes
+   if (value.size() > 2 && value[value.size() - 1] == '\0')
+   {
+      if (value[value.size() - 2] == '\1' || value[value.size() - 2] == '\2')
+      {
+         header = header_type(value); // \1 \0 means header, \2 \0 means blob header
+         header.pushed = pushed;
+         header.expires = expires;
+      }
+      else if (value[value.size() - 2] == '\0') // \0 \0 means escaped \0
+         value.resize(value.size() - 1);
+      else
+         throw system::system_error(system::errc::io_error,
+            boost::asio::error::get_system_category()); // anything else is bad data
+   }
+
+   if (header.end <= 1)
+      header.size = value.size();
+}
+
+void queue::header_type::str(std::string& out) const
+{
+   id_type fields[5] = { beg, end, size, file, offset };
+   if (blob)
+      out = string(reinterpret_cast<const char *>(fields), 5 * sizeof(id_type)) + '\2' + '\0';
+   else
+      out = string(reinterpret_cast<const char *>(fields), 3 * sizeof(id_type)) + '\1' + '\0';
+}
+
+queue::key_type::key_type(const leveldb::Slice& s)
+: type(s.data()[0]),
+  id(0)
+{
+   for (size_t i = 1; i != sizeof(buf_); ++i)
+      id = (id << 8) | static_cast<unsigned char>(s.data()[i]);
+}
+
+queue::key_type queue::key_type::legacy(const leveldb::Slice& s)
 {
-   out = string(reinterpret_cast<const char *>(this), sizeof(header_type)) + '\1' + '\0';
+   return key_type(s.data()[sizeof(id_type)], *reinterpret_cast<const id_type*>(s.data()));
 }
 
 leveldb::Slice queue::key_type::slice() const
 {
-   *reinterpret_cast<id_type*>(&buf_[0]) = id;
-   buf_[sizeof(id_type)] = type;
+   buf_[0] = type;
+   for (size_t i = 0; i != sizeof(id_type); ++i)
+      buf_[sizeof(buf_) - 1 - i] = static_cast<char>(id >> (8 * i));
    return leveldb::Slice(&buf_[0], sizeof(buf_));
 }
 
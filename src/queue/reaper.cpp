@@ -0,0 +1,163 @@
+#include "darner/queue/reaper.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include "darner/queue/queue.h"
+#include "darner/queue/page_cache_env.h"
+#include "darner/util/log.h"
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+reaper::size_type reaper::page_cache_count::bytes() const
+{
+   mutex::scoped_lock lock(mutex_);
+   return bytes_;
+}
+
+void reaper::page_cache_count::update()
+{
+   size_type bytes;
+   try
+   {
+      bytes = page_cache_env::resident_bytes(path_);
+   }
+   catch (const filesystem::filesystem_error&) // destroyed while we weren't looking
+   {
+      return;
+   }
+
+   mutex::scoped_lock lock(mutex_);
+   bytes_ = bytes;
+}
+
+reaper::reaper(size_type rate /* = 0 */, size_type count_ms /* = 10000 */)
+: rate_(rate),
+  count_ms_(count_ms),
+  stopping_(false),
+  pending_(0),
+  journals_reaped_(0),
+  files_reaped_(0),
+  work_(new asio::io_service::work(ios_)),
+  count_timer_(ios_)
+{
+   arm_count();
+   thread_ = boost::thread(boost::bind(&asio::io_service::run, &ios_));
+}
+
+reaper::~reaper()
+{
+   {
+      mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+   }
+   ios_.stop();
+   thread_.join();
+}
+
+void reaper::reap(const string& path)
+{
+   {
+      mutex::scoped_lock lock(mutex_);
+      ++pending_;
+   }
+   ios_.post(bind(&reaper::run, this, path));
+}
+
+shared_ptr<const reaper::page_cache_count> reaper::count_page_cache(const string& path)
+{
+   shared_ptr<page_cache_count> result = make_shared<page_cache_count>(path);
+   {
+      mutex::scoped_lock lock(mutex_);
+      counts_.push_back(result);
+   }
+   ios_.post(bind(&page_cache_count::update, result));
+   return result;
+}
+
+void reaper::write_stats(ostringstream& out) const
+{
+   mutex::scoped_lock lock(mutex_);
+   out << "STAT reaps_pending " << pending_ << "\r\n";
+   out << "STAT journals_reaped " << journals_reaped_ << "\r\n";
+   out << "STAT journal_files_reaped " << files_reaped_ << "\r\n";
+}
+
+void reaper::run(const string& path)
+{
+   try
+   {
+      filesystem::path mark(queue::destroyed_path(path));
+      vector<filesystem::path> files;
+      filesystem::recursive_directory_iterator end_it;
+      for (filesystem::recursive_directory_iterator it(path); it != end_it; ++it)
+      {
+         if (!filesystem::is_directory(it->status()) && it->path() != mark)
+            files.push_back(it->path());
+      }
+
+      for (vector<filesystem::path>::const_iterator it = files.begin(); it != files.end(); ++it)
+      {
+         {
+            mutex::scoped_lock lock(mutex_);
+            if (stopping_)
+               return;
+            ++files_reaped_;
+         }
+         filesystem::remove(*it);
+         if (rate_)
+            this_thread::sleep(posix_time::microseconds(1000000 / rate_));
+      }
+
+      filesystem::remove_all(path); // the mark, and any directories
+      log::INFO("reaper: deleted %1%", path);
+
+      mutex::scoped_lock lock(mutex_);
+      --pending_;
+      ++journals_reaped_;
+   }
+   catch (const filesystem::filesystem_error& ex)
+   {
+      log::ERROR("reaper: couldn't delete %1%: %2%", path, ex.what());
+
+      mutex::scoped_lock lock(mutex_);
+      --pending_;
+   }
+}
+
+void reaper::arm_count()
+{
+   count_timer_.expires_from_now(posix_time::milliseconds(count_ms_));
+   count_timer_.async_wait(bind(&reaper::count_timeout, this, asio::placeholders::error));
+}
+
+void reaper::count_timeout(const system::error_code& e)
+{
+   if (e)
+      return;
+
+   // a count nobody holds any more belongs to a queue that's gone
+   vector<shared_ptr<page_cache_count> > counts;
+   {
+      mutex::scoped_lock lock(mutex_);
+      vector<weak_ptr<page_cache_count> > live;
+      for (vector<weak_ptr<page_cache_count> >::const_iterator it = counts_.begin(); it != counts_.end(); ++it)
+      {
+         if (shared_ptr<page_cache_count> c = it->lock())
+         {
+            counts.push_back(c);
+            live.push_back(c);
+         }
+      }
+      counts_.swap(live);
+   }
+
+   for (vector<shared_ptr<page_cache_count> >::const_iterator it = counts.begin(); it != counts.end(); ++it)
+      (*it)->update();
+   arm_count();
+}
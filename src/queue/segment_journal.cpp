@@ -0,0 +1,628 @@
+#include "darner/queue/segment_journal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include "darner/util/log.h"
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+namespace {
+
+// a record is a header followed by a payload of ops:
+// record: | crc32 (of everything after it) | payload length | payload |
+// op:     | type | key size | value size (puts only) | key | value (puts only) |
+
+const size_t header_size = 2 * sizeof(boost::uint32_t);
+
+enum { OP_DELETE = 0, OP_PUT = 1 };
+
+const char* journal_file = "JOURNAL";
+const char* segment_suffix = ".seg";
+
+leveldb::Status io_error(const string& context)
+{
+   return leveldb::Status::IOError(context, strerror(errno));
+}
+
+bool write_all(int fd, const char* buf, size_t size, off_t offset)
+{
+   while (size)
+   {
+      ssize_t written = ::pwrite(fd, buf, size, offset);
+      if (written < 0 && errno == EINTR)
+         continue;
+      else if (written <= 0)
+         return false;
+      buf += written;
+      size -= written;
+      offset += written;
+   }
+   return true;
+}
+
+bool read_all(int fd, char* buf, size_t size, off_t offset)
+{
+   while (size)
+   {
+      ssize_t bytes = ::pread(fd, buf, size, offset);
+      if (bytes < 0 && errno == EINTR)
+         continue;
+      else if (bytes <= 0)
+         return false;
+      buf += bytes;
+      size -= bytes;
+      offset += bytes;
+   }
+   return true;
+}
+
+boost::uint32_t checksum(const char* buf, size_t size)
+{
+   boost::crc_32_type crc;
+   crc.process_bytes(buf, size);
+   return crc.checksum();
+}
+
+} // anonymous
+
+// serializes a WriteBatch into a record, remembering where each value will land
+class segment_journal::record_builder : public leveldb::WriteBatch::Handler
+{
+public:
+
+   record_builder() : record_(header_size, '\0') {}
+
+   void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+   {
+      append(OP_PUT, key);
+      boost::uint32_t value_size = value.size();
+      record_.append(reinterpret_cast<const char*>(&value_size), sizeof(value_size));
+      record_.append(key.data(), key.size());
+      ops_.back().value_offset = record_.size();
+      ops_.back().value_size = value.size();
+      record_.append(value.data(), value.size());
+   }
+
+   void Delete(const leveldb::Slice& key)
+   {
+      append(OP_DELETE, key);
+      record_.append(key.data(), key.size());
+   }
+
+   // fills in the header and returns the finished record
+   const string& finish()
+   {
+      boost::uint32_t payload_size = record_.size() - header_size;
+      memcpy(&record_[sizeof(boost::uint32_t)], &payload_size, sizeof(payload_size));
+      boost::uint32_t crc = checksum(&record_[sizeof(boost::uint32_t)], record_.size() - sizeof(boost::uint32_t));
+      memcpy(&record_[0], &crc, sizeof(crc));
+      return record_;
+   }
+
+   const vector<op>& ops() const { return ops_; }
+
+   // parses the ops out of a record that was read back from disk
+   static bool parse(const char* record, size_t size, vector<op>& result)
+   {
+      result.clear();
+      for (size_t pos = header_size; pos != size;)
+      {
+         op o;
+         boost::uint32_t key_size, value_size = 0;
+         if (pos + 1 + sizeof(key_size) > size)
+            return false;
+         o.put = record[pos++] == OP_PUT;
+         memcpy(&key_size, record + pos, sizeof(key_size));
+         pos += sizeof(key_size);
+         if (o.put)
+         {
+            if (pos + sizeof(value_size) > size)
+               return false;
+            memcpy(&value_size, record + pos, sizeof(value_size));
+            pos += sizeof(value_size);
+         }
+         if (pos + key_size + value_size > size)
+            return false;
+         o.key.assign(record + pos, key_size);
+         o.value_offset = pos + key_size;
+         o.value_size = value_size;
+         pos += key_size + value_size;
+         result.push_back(o);
+      }
+      return true;
+   }
+
+private:
+
+   void append(char type, const leveldb::Slice& key)
+   {
+      op o;
+      o.put = type == OP_PUT;
+      o.key = key.ToString();
+      o.value_offset = o.value_size = 0;
+      ops_.push_back(o);
+
+      boost::uint32_t key_size = key.size();
+      record_ += type;
+      record_.append(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+   }
+
+   string record_;
+   vector<op> ops_;
+};
+
+// walks the index.  rather than holding on to index iterators (which a concurrent erase could invalidate), we remember
+// the current key and look it back up on every move
+class segment_journal::iterator : public leveldb::Iterator
+{
+public:
+
+   iterator(segment_journal& journal) : journal_(journal), valid_(false), loaded_(false) {}
+
+   bool Valid() const { return valid_; }
+
+   void SeekToFirst()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      load(journal_.index_.begin());
+   }
+
+   void SeekToLast()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      index_type::iterator it = journal_.index_.end();
+      load(journal_.index_.empty() ? it : --it);
+   }
+
+   void Seek(const leveldb::Slice& target)
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      load(journal_.index_.lower_bound(target.ToString()));
+   }
+
+   void Next()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      load(journal_.index_.upper_bound(key_));
+   }
+
+   void Prev()
+   {
+      mutex::scoped_lock lock(journal_.mutex_);
+      index_type::iterator it = journal_.index_.lower_bound(key_);
+      load(it == journal_.index_.begin() ? journal_.index_.end() : --it);
+   }
+
+   leveldb::Slice key() const { return key_; }
+
+   leveldb::Slice value() const
+   {
+      if (!loaded_) // values are only read off disk if asked for
+      {
+         mutex::scoped_lock lock(journal_.mutex_);
+         status_ = journal_.read(location_, value_);
+         loaded_ = true;
+      }
+      return value_;
+   }
+
+   leveldb::Status status() const { return status_; }
+
+private:
+
+   void load(index_type::iterator it)
+   {
+      valid_ = it != journal_.index_.end();
+      loaded_ = false;
+      if (valid_)
+      {
+         key_ = it->first;
+         location_ = it->second;
+      }
+   }
+
+   segment_journal& journal_;
+
+   bool valid_;
+   string key_;
+   location location_;
+
+   mutable bool loaded_;
+   mutable string value_;
+   mutable leveldb::Status status_;
+};
+
+bool segment_journal::exists(const string& path)
+{
+   return filesystem::exists(filesystem::path(path) / journal_file);
+}
+
+leveldb::Status segment_journal::open(const leveldb::Comparator* cmp, const string& path, size_type segment_size,
+   bool create_if_missing, leveldb::DB** result)
+{
+   *result = NULL;
+   filesystem::path journal_path = filesystem::path(path) / journal_file;
+
+   // like leveldb, the journal remembers the name of its comparator, so we don't read keys back in the wrong order
+   if (!filesystem::exists(journal_path))
+   {
+      if (!create_if_missing)
+         return leveldb::Status::InvalidArgument(path, "does not exist (create_if_missing is false)");
+      filesystem::create_directories(path);
+      filesystem::ofstream out(journal_path);
+      out << cmp->Name() << endl;
+      if (!out)
+         return io_error(journal_path.string());
+   }
+   else
+   {
+      filesystem::ifstream in(journal_path);
+      string name;
+      getline(in, name);
+      if (name != cmp->Name())
+         return leveldb::Status::InvalidArgument(cmp->Name(), "does not match existing comparator " + name);
+   }
+
+   segment_journal* journal = new segment_journal(cmp, path, segment_size);
+
+   journal->lock_fd_ = ::open(journal_path.string().c_str(), O_RDWR);
+   struct flock lock;
+   memset(&lock, 0, sizeof(lock));
+   lock.l_type = F_WRLCK;
+   lock.l_whence = SEEK_SET;
+   if (journal->lock_fd_ < 0 || ::fcntl(journal->lock_fd_, F_SETLK, &lock) < 0)
+   {
+      leveldb::Status status = io_error("lock " + journal_path.string());
+      delete journal;
+      return status;
+   }
+
+   leveldb::Status status = journal->recover();
+   if (!status.ok())
+   {
+      delete journal;
+      return status;
+   }
+
+   *result = journal;
+   return status;
+}
+
+segment_journal::~segment_journal()
+{
+   for (deque<segment>::iterator it = segments_.begin(); it != segments_.end(); ++it)
+      ::close(it->fd);
+   if (lock_fd_ >= 0)
+      ::close(lock_fd_);
+}
+
+leveldb::Status segment_journal::Put(const leveldb::WriteOptions& options, const leveldb::Slice& key,
+   const leveldb::Slice& value)
+{
+   leveldb::WriteBatch batch;
+   batch.Put(key, value);
+   return Write(options, &batch);
+}
+
+leveldb::Status segment_journal::Delete(const leveldb::WriteOptions& options, const leveldb::Slice& key)
+{
+   leveldb::WriteBatch batch;
+   batch.Delete(key);
+   return Write(options, &batch);
+}
+
+leveldb::Status segment_journal::Write(const leveldb::WriteOptions& options, leveldb::WriteBatch* updates)
+{
+   record_builder builder;
+   if (updates)
+   {
+      leveldb::Status status = updates->Iterate(&builder);
+      if (!status.ok())
+         return status;
+   }
+
+   mutex::scoped_lock lock(mutex_);
+
+   if (!builder.ops().empty())
+   {
+      const string& record = builder.finish();
+
+      if (segments_.back().size && segments_.back().size + record.size() > segment_size_)
+      {
+         leveldb::Status status = roll();
+         if (!status.ok())
+            return status;
+      }
+
+      segment& seg = segments_.back();
+      if (!write_all(seg.fd, record.data(), record.size(), seg.size))
+      {
+         leveldb::Status status = io_error(segment_path(seg.id));
+         // don't leave a partial record behind for the next write to append after
+         if (::ftruncate(seg.fd, seg.size) < 0)
+            log::ERROR("segment_journal<%1%>: can't truncate partial record: %2%", path_, strerror(errno));
+         return status;
+      }
+
+      apply(builder.ops(), seg, seg.size);
+      seg.size += record.size();
+      seg.dirty = true;
+   }
+
+   leveldb::Status status = options.sync ? sync() : leveldb::Status::OK();
+
+   reclaim();
+
+   return status;
+}
+
+leveldb::Status segment_journal::Get(const leveldb::ReadOptions& options, const leveldb::Slice& key, string* value)
+{
+   mutex::scoped_lock lock(mutex_);
+
+   index_type::const_iterator it = index_.find(key.ToString());
+   if (it == index_.end())
+      return leveldb::Status::NotFound(key);
+
+   return read(it->second, *value);
+}
+
+leveldb::Iterator* segment_journal::NewIterator(const leveldb::ReadOptions& options)
+{
+   return new iterator(*this);
+}
+
+bool segment_journal::GetProperty(const leveldb::Slice& property, string* value)
+{
+   if (property != leveldb::Slice("darner.segments"))
+      return false;
+
+   mutex::scoped_lock lock(mutex_);
+   *value = lexical_cast<string>(segments_.size());
+   return true;
+}
+
+void segment_journal::GetApproximateSizes(const leveldb::Range* range, int n, uint64_t* sizes)
+{
+   mutex::scoped_lock lock(mutex_);
+
+   for (int i = 0; i != n; ++i)
+   {
+      sizes[i] = 0;
+      index_type::const_iterator end = index_.lower_bound(range[i].limit.ToString());
+      for (index_type::const_iterator it = index_.lower_bound(range[i].start.ToString()); it != end; ++it)
+         sizes[i] += it->first.size() + it->second.size;
+   }
+}
+
+// private:
+
+segment_journal::segment_journal(const leveldb::Comparator* cmp, const string& path, size_type segment_size)
+: cmp_(cmp),
+  path_(path),
+  segment_size_(segment_size),
+  lock_fd_(-1),
+  index_(key_less(cmp))
+{
+}
+
+leveldb::Status segment_journal::recover()
+{
+   vector<id_type> ids;
+   filesystem::directory_iterator end_it;
+   for (filesystem::directory_iterator it(path_); it != end_it; ++it)
+   {
+      string name = filesystem::path(it->path().filename()).string(); // useless recast for boost backwards compat
+      if (name.size() <= strlen(segment_suffix) || name.compare(name.size() - strlen(segment_suffix), string::npos,
+         segment_suffix) != 0)
+         continue;
+      try
+      {
+         ids.push_back(lexical_cast<id_type>(name.substr(0, name.size() - strlen(segment_suffix))));
+      }
+      catch (const bad_lexical_cast&)
+      {
+         // not one of ours
+      }
+   }
+   sort(ids.begin(), ids.end());
+
+   for (vector<id_type>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+   {
+      int fd = ::open(segment_path(*it).c_str(), O_RDWR);
+      if (fd < 0)
+         return io_error(segment_path(*it));
+      segments_.push_back(segment(*it, fd));
+      leveldb::Status status = replay(segments_.back());
+      if (!status.ok())
+         return status;
+   }
+
+   // keep appending to the last segment, or start the first one
+   if (segments_.empty())
+   {
+      leveldb::Status status = roll();
+      if (!status.ok())
+         return status;
+   }
+
+   reclaim();
+
+   return leveldb::Status::OK();
+}
+
+leveldb::Status segment_journal::replay(segment& seg)
+{
+   off_t file_size = ::lseek(seg.fd, 0, SEEK_END);
+   if (file_size < 0)
+      return io_error(segment_path(seg.id));
+
+   // read the segment sequentially in big blocks, records may straddle blocks
+   const size_t block_size = 1048576;
+   string buf;
+   size_type buf_offset = 0;
+   vector<op> ops;
+
+   while (seg.size + header_size <= static_cast<size_type>(file_size))
+   {
+      boost::uint32_t crc, payload_size;
+      if (seg.size + header_size > buf_offset + buf.size())
+      {
+         buf.resize(min<size_type>(max(block_size, header_size), file_size - seg.size));
+         buf_offset = seg.size;
+         if (!read_all(seg.fd, &buf[0], buf.size(), buf_offset))
+            return io_error(segment_path(seg.id));
+      }
+      memcpy(&crc, &buf[seg.size - buf_offset], sizeof(crc));
+      memcpy(&payload_size, &buf[seg.size - buf_offset + sizeof(crc)], sizeof(payload_size));
+
+      size_type record_size = header_size + payload_size;
+      if (seg.size + record_size > static_cast<size_type>(file_size))
+         break; // torn
+      if (seg.size + record_size > buf_offset + buf.size())
+      {
+         buf.resize(min<size_type>(max<size_type>(block_size, record_size), file_size - seg.size));
+         buf_offset = seg.size;
+         if (!read_all(seg.fd, &buf[0], buf.size(), buf_offset))
+            return io_error(segment_path(seg.id));
+      }
+
+      const char* record = &buf[seg.size - buf_offset];
+      if (crc != checksum(record + sizeof(crc), record_size - sizeof(crc)) ||
+          !record_builder::parse(record, record_size, ops))
+         break; // corrupt
+
+      apply(ops, seg, seg.size);
+      seg.size += record_size;
+   }
+
+   if (seg.size != static_cast<size_type>(file_size))
+   {
+      log::ERROR("segment_journal<%1%>: dropping %2% bytes of torn or corrupt records from segment %3%", path_,
+         file_size - seg.size, seg.id);
+      if (::ftruncate(seg.fd, seg.size) < 0)
+         return io_error(segment_path(seg.id));
+   }
+
+   return leveldb::Status::OK();
+}
+
+leveldb::Status segment_journal::roll()
+{
+   id_type id = segments_.empty() ? 0 : segments_.back().id + 1;
+   int fd = ::open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      return io_error(segment_path(id));
+   segments_.push_back(segment(id, fd));
+   return leveldb::Status::OK();
+}
+
+void segment_journal::apply(const vector<op>& ops, segment& seg, size_type offset)
+{
+   for (vector<op>::const_iterator it = ops.begin(); it != ops.end(); ++it)
+   {
+      if (it->put)
+      {
+         location loc;
+         loc.segment = seg.id;
+         loc.offset = offset + it->value_offset;
+         loc.size = it->value_size;
+         pair<index_type::iterator, bool> result = index_.insert(index_type::value_type(it->key, loc));
+         if (!result.second) // overwrite
+         {
+            release(result.first->second);
+            result.first->second = loc;
+         }
+         ++seg.live;
+      }
+      else
+      {
+         index_type::iterator existing = index_.find(it->key);
+         if (existing != index_.end())
+         {
+            release(existing->second);
+            index_.erase(existing);
+         }
+      }
+   }
+}
+
+void segment_journal::release(const location& loc)
+{
+   segment* seg = find_segment(loc.segment);
+   if (seg && seg->live)
+      --seg->live;
+}
+
+void segment_journal::reclaim()
+{
+   while (segments_.size() > 1 && !segments_.front().live)
+   {
+      ::close(segments_.front().fd);
+      if (::unlink(segment_path(segments_.front().id).c_str()) < 0)
+         log::ERROR("segment_journal<%1%>: can't unlink segment %2%: %3%", path_, segments_.front().id,
+            strerror(errno));
+      segments_.pop_front();
+   }
+}
+
+leveldb::Status segment_journal::sync()
+{
+   for (deque<segment>::iterator it = segments_.begin(); it != segments_.end(); ++it)
+   {
+      if (!it->dirty)
+         continue;
+      if (::fdatasync(it->fd) < 0)
+         return io_error(segment_path(it->id));
+      it->dirty = false;
+   }
+   return leveldb::Status::OK();
+}
+
+leveldb::Status segment_journal::read(const location& loc, string& result)
+{
+   segment* seg = find_segment(loc.segment);
+   if (!seg)
+      return leveldb::Status::NotFound("segment reclaimed");
+
+   result.resize(loc.size);
+   if (loc.size && !read_all(seg->fd, &result[0], loc.size, loc.offset))
+      return io_error(segment_path(loc.segment));
+
+   return leveldb::Status::OK();
+}
+
+segment_journal::segment* segment_journal::find_segment(id_type id)
+{
+   // segment ids are contiguous, save for gaps a crash could leave behind, so try the direct offset first
+   if (!segments_.empty() && id >= segments_.front().id)
+   {
+      size_type pos = id - segments_.front().id;
+      if (pos < segments_.size() && segments_[pos].id == id)
+         return &segments_[pos];
+   }
+   for (deque<segment>::iterator it = segments_.begin(); it != segments_.end(); ++it)
+   {
+      if (it->id == id)
+         return &*it;
+   }
+   return NULL;
+}
+
+string segment_journal::segment_path(id_type id) const
+{
+   return (filesystem::path(path_) / (lexical_cast<string>(id) + segment_suffix)).string();
+}
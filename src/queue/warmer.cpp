@@ -0,0 +1,108 @@
+#include "darner/queue/warmer.h"
+
+#include <boost/bind.hpp>
+
+using namespace std;
+using namespace boost;
+using namespace darner;
+
+warmer::warmer(size_type rate /* = 0 */)
+: rate_(rate),
+  next_step_(posix_time::microsec_clock::universal_time()),
+  stopping_(false),
+  next_ticket_(0),
+  running_(false),
+  running_ticket_(0),
+  warmups_(0),
+  bytes_read_(0)
+{
+   thread_ = boost::thread(bind(&warmer::work, this));
+}
+
+warmer::~warmer()
+{
+   {
+      mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+   }
+   changed_.notify_all();
+   thread_.join();
+}
+
+warmer::ticket_type warmer::post(const step_type& step)
+{
+   pending p;
+   p.step = step;
+   {
+      mutex::scoped_lock lock(mutex_);
+      p.ticket = next_ticket_++;
+      pending_.push_back(p);
+   }
+   changed_.notify_all();
+   return p.ticket;
+}
+
+void warmer::cancel(ticket_type ticket)
+{
+   mutex::scoped_lock lock(mutex_);
+   while (running_ && running_ticket_ == ticket)
+      changed_.wait(lock);
+   for (list<pending>::iterator it = pending_.begin(); it != pending_.end(); ++it)
+   {
+      if (it->ticket == ticket)
+      {
+         pending_.erase(it);
+         return;
+      }
+   }
+}
+
+void warmer::write_stats(ostringstream& out) const
+{
+   mutex::scoped_lock lock(mutex_);
+   out << "STAT warmups_pending " << pending_.size() << "\r\n";
+   out << "STAT warmups " << warmups_ << "\r\n";
+   out << "STAT warm_bytes_read " << bytes_read_ << "\r\n";
+}
+
+void warmer::work()
+{
+   mutex::scoped_lock lock(mutex_);
+   for (;;)
+   {
+      if (stopping_)
+         return;
+
+      if (pending_.empty())
+      {
+         changed_.wait(lock);
+         continue;
+      }
+
+      posix_time::ptime now = posix_time::microsec_clock::universal_time();
+      if (rate_ && now < next_step_)
+      {
+         changed_.timed_wait(lock, next_step_);
+         continue; // maybe stopping, or the warm-up was cancelled
+      }
+
+      pending p = pending_.front();
+      pending_.pop_front();
+      running_ = true;
+      running_ticket_ = p.ticket;
+
+      lock.unlock();
+      size_type bytes = p.step();
+      lock.lock();
+
+      running_ = false;
+      bytes_read_ += bytes;
+      if (rate_)
+         next_step_ = max(now, next_step_) + posix_time::microseconds(bytes * 1000000 / rate_);
+      if (bytes)
+         pending_.push_back(p); // back of the line
+      else
+         ++warmups_;
+      changed_.notify_all(); // anyone cancelling it can go ahead
+   }
+}
@@ -21,7 +21,9 @@ public:
 
    basic_queue()
    : cb_count_(0),
+     push_count_(0),
      wait_cb_(boost::bind(&basic_queue::wait_cb, this, _1)),
+     push_cb_(boost::bind(&basic_queue::push_cb, this, _1)),
 #if BOOST_VERSION < 104600
      tmp_("/tmp/basic_queue_fixture")
 #else
@@ -63,11 +65,20 @@ protected:
       ++cb_count_;
    }
 
+   void push_cb(const boost::system::error_code& error)
+   {
+      if (!error_)
+         error_ = error;
+      ++push_count_;
+   }
+
    std::string pop_value_;
 
    boost::system::error_code error_;
    size_t cb_count_;
+   size_t push_count_;
    darner::queue::wait_callback wait_cb_;
+   darner::queue::push_callback push_cb_;
 
    boost::asio::io_service ios_;
    boost::shared_ptr<darner::queue> queue_;
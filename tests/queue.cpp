@@ -1,9 +1,18 @@
+#include <fstream>
+
+#include <unistd.h>
+
 #include <boost/test/unit_test.hpp>
 #include <boost/test/test_tools.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "darner/queue/queue.h"
 #include "darner/queue/iqstream.h"
 #include "darner/queue/oqstream.h"
+#include "darner/queue/segment_journal.h"
+#include "darner/util/queue_map.hpp"
 #include "fixtures/basic_queue.hpp"
 
 using namespace std;
@@ -210,4 +219,1254 @@ BOOST_FIXTURE_TEST_CASE( test_delete_queue, fixtures::basic_queue )
    BOOST_REQUIRE(!filesystem::exists(tmp_ / "queue.0")); // finally, destroying the queue deletes the journal
 }
 
+// test that a queue can push and pop through a segment journal, and reload it
+BOOST_FIXTURE_TEST_CASE( test_segment_journal, fixtures::basic_queue )
+{
+   string value1 = "I feel like I'm too busy writing history to read it";
+   string value2 = "Sometimes people write novels and they just be so wordy and so self-absorbed";
+   darner::queue::options options;
+   options.journal = darner::queue::options::JT_SEGMENT;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "segments").string(), options));
+
+   oqs_.open(queue_, 1);
+   oqs_.write(value1);
+   oqs_.open(queue_, 2);
+   oqs_.write(value1);
+   oqs_.write(value2);
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   iqs_.close(true);
+
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "segments").string())); // existing journals keep their type
+   BOOST_REQUIRE(darner::segment_journal::exists((tmp_ / "segments").string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value1);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value2);
+}
+
+// test that a segment journal unlinks segments once everything in them is popped
+BOOST_FIXTURE_TEST_CASE( test_segment_journal_reclaim, fixtures::basic_queue )
+{
+   string value = "My dad used to say 'always fight fire with fire', which is probably why he got kicked out of the "
+                  "fire department";
+   darner::queue::options options;
+   options.journal = darner::queue::options::JT_SEGMENT;
+   options.segment_size = 1024;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "segments").string(), options));
+
+   for (size_t i = 0; i != 100; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+
+   size_t segments = std::distance(filesystem::directory_iterator(tmp_ / "segments"), filesystem::directory_iterator());
+   BOOST_REQUIRE_GT(segments, 10);
+
+   for (size_t i = 0; i != 100; ++i)
+   {
+      iqs_.open(queue_);
+      iqs_.read(pop_value_);
+      iqs_.close(true);
+   }
+   ios_.run(); // commit the erases
+
+   // just the JOURNAL file and the active segment
+   segments = std::distance(filesystem::directory_iterator(tmp_ / "segments"), filesystem::directory_iterator());
+   BOOST_REQUIRE_EQUAL(segments, 2);
+}
+
+// test that synced pushes are committed together, and only become poppable once they are
+BOOST_FIXTURE_TEST_CASE( test_group_commit, fixtures::basic_queue )
+{
+   string value = "I still think I am the greatest";
+   oqs_.open(queue_, 1, true);
+   oqs_.write(value, push_cb_);
+   oqs_.open(queue_, 2, true);
+   oqs_.write(value);
+   oqs_.write(value, push_cb_);
+   oqs_.open(queue_, 1, false); // not synced, but it's in the same batch
+   oqs_.write(value, push_cb_);
+
+   BOOST_REQUIRE_EQUAL(push_count_, 0);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+   BOOST_REQUIRE(!iqs_.open(queue_));
+
+   ios_.run();
+
+   BOOST_REQUIRE(!error_);
+   BOOST_REQUIRE_EQUAL(push_count_, 3);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 3);
+
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 3);
+}
+
+// test that we parse journal sync policies
+BOOST_AUTO_TEST_CASE( test_sync_journal_options )
+{
+   darner::queue::options options;
+   BOOST_REQUIRE_EQUAL(options.sync_journal, darner::queue::options::ST_NEVER);
+   BOOST_REQUIRE(options.set("sync_journal", "250ms"));
+   BOOST_REQUIRE_EQUAL(options.sync_journal, darner::queue::options::ST_MILLISECONDS);
+   BOOST_REQUIRE_EQUAL(options.sync_every, 250);
+   BOOST_REQUIRE(options.set("sync_journal", "1000items"));
+   BOOST_REQUIRE_EQUAL(options.sync_journal, darner::queue::options::ST_ITEMS);
+   BOOST_REQUIRE_EQUAL(options.sync_every, 1000);
+   BOOST_REQUIRE(options.set("sync_journal", "always"));
+   BOOST_REQUIRE_EQUAL(options.sync_journal, darner::queue::options::ST_ALWAYS);
+   BOOST_REQUIRE(!options.set("sync_journal", "0ms"));
+   BOOST_REQUIRE(!options.set("sync_journal", "sometimes"));
+}
+
+// test the leveldb tuning options, and queues sharing a block cache
+BOOST_FIXTURE_TEST_CASE( test_leveldb_options, fixtures::basic_queue )
+{
+   string value = "We culture. Rap is the new rock 'n' roll. We rock stars";
+   darner::queue::options options;
+   BOOST_REQUIRE(options.compression);
+   BOOST_REQUIRE(options.set("compression", "off"));
+   BOOST_REQUIRE(!options.compression);
+   BOOST_REQUIRE(!options.set("compression", "maybe"));
+   BOOST_REQUIRE(options.set("write_buffer_size", "65536"));
+   BOOST_REQUIRE_EQUAL(options.write_buffer_size, 65536);
+   BOOST_REQUIRE(options.set("block_size", "16384"));
+   BOOST_REQUIRE_EQUAL(options.block_size, 16384);
+   BOOST_REQUIRE(options.set("max_open_files", "64"));
+   BOOST_REQUIRE_EQUAL(options.max_open_files, 64);
+   BOOST_REQUIRE(!options.set("block_cache", "1"));
+
+   filesystem::create_directories(tmp_ / "data");
+   darner::queue_map queues(ios_, (tmp_ / "data").string(), options, darner::queue_map::options_map(), 1, 0, 0,
+      1048576);
+   for (size_t i = 0; i != 2; ++i)
+   {
+      oqs_.open(queues["tuned" + lexical_cast<string>(i)], 1);
+      oqs_.write(value);
+      BOOST_REQUIRE(iqs_.open(queues["tuned" + lexical_cast<string>(i)]));
+      iqs_.read(pop_value_);
+      BOOST_REQUIRE_EQUAL(pop_value_, value);
+      iqs_.close(true);
+   }
+
+   ostringstream out;
+   queues.write_stats(out);
+   BOOST_REQUIRE(out.str().find("STAT block_cache_bytes ") != string::npos);
+}
+
+// test that an always-synced queue group commits every push
+BOOST_FIXTURE_TEST_CASE( test_sync_journal_always, fixtures::basic_queue )
+{
+   string value = "Keep your nose out the sky, keep your heart to god, and keep your face to the rising sun";
+   darner::queue::options options;
+   options.sync_journal = darner::queue::options::ST_ALWAYS;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "synced").string(), options));
+
+   oqs_.open(queue_, 1);
+   oqs_.write(value, push_cb_);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0); // waiting on the group commit
+
+   ios_.run();
+   BOOST_REQUIRE_EQUAL(push_count_, 1);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+}
+
+// test that pushes made in one turn of the event loop are written together, in order, and wake up waiters
+BOOST_FIXTURE_TEST_CASE( test_push_batch, fixtures::basic_queue )
+{
+   string value1 = "I'm not even gon' lie to you. I love me some me";
+   string value2 = "I'm living the dream";
+   queue_->wait(100, wait_cb_);
+   oqs_.open(queue_, 1);
+   oqs_.write(value1, push_cb_);
+   oqs_.open(queue_, 1);
+   oqs_.write(value2, push_cb_);
+
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+
+   ios_.run();
+
+   BOOST_REQUIRE(!error_);
+   BOOST_REQUIRE_EQUAL(cb_count_, 1); // the waiter woke up...
+   BOOST_REQUIRE_EQUAL(push_count_, 2); // ...and both pushes were acknowledged
+   BOOST_REQUIRE_EQUAL(queue_->count(), 2);
+
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value1);
+   iqs_.close(true);
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value2);
+}
+
+// test that with a sync window, synced pushes are poppable right away but only acknowledged after the window's fsync
+BOOST_FIXTURE_TEST_CASE( test_sync_window, fixtures::basic_queue )
+{
+   string value = "I am Warhol. I am the No. 1 most impactful artist of our generation";
+   darner::queue::options options;
+   options.sync_window_ms = 50;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "windowed").string(), options));
+
+   oqs_.open(queue_, 1, true);
+   oqs_.write(value, push_cb_);
+
+   ios_.poll(); // just the commit, not the window
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+   BOOST_REQUIRE_EQUAL(push_count_, 0);
+
+   ios_.run();
+   BOOST_REQUIRE(!error_);
+   BOOST_REQUIRE_EQUAL(push_count_, 1);
+}
+
+// test erases are batched up per loop turn, and still make it to the journal if the queue goes first
+BOOST_FIXTURE_TEST_CASE( test_erase_batch, fixtures::basic_queue )
+{
+   string value = "Nobody crazier than me";
+   for (size_t i = 0; i != 3; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+
+   darner::iqstream iqs1, iqs2;
+   BOOST_REQUIRE(iqs_.open(queue_));
+   BOOST_REQUIRE(iqs1.open(queue_));
+   BOOST_REQUIRE(iqs2.open(queue_));
+   iqs_.close(true);
+   iqs1.close(true);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+
+   ios_.run(); // one commit for both
+
+   iqs2.close(true);
+   queue_.reset(); // no loop turn for this one, so the dtor writes it
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+}
+
+// test newly pushed items are popped from the cache, and older ones fall back to the journal once evicted
+BOOST_FIXTURE_TEST_CASE( test_tail_cache, fixtures::basic_queue )
+{
+   string value1 = "I'm a creative genius";
+   string value2 = "there's no other way to word it";
+   darner::queue::options options;
+   options.cache_size = value2.size();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "cached").string(), options));
+
+   oqs_.open(queue_, 1);
+   oqs_.write(value1);
+   oqs_.open(queue_, 1);
+   oqs_.write(value2); // evicts value1
+
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value1);
+   iqs_.close(true);
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value2);
+   iqs_.close(true);
+
+   ostringstream out;
+   queue_->write_stats("cached", out);
+   BOOST_REQUIRE(out.str().find("STAT queue_cached_cache_hits 1\r\n") != string::npos);
+   BOOST_REQUIRE(out.str().find("STAT queue_cached_cache_misses 1\r\n") != string::npos);
+   BOOST_REQUIRE(out.str().find("STAT queue_cached_cache_bytes 0\r\n") != string::npos);
+}
+
+// test a miss reads the next few items ahead, so the pops after it hit the cache
+BOOST_FIXTURE_TEST_CASE( test_read_ahead, fixtures::basic_queue )
+{
+   string value = "I feel like I'm too busy writing history to read it";
+   for (size_t i = 0; i != 10; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+
+   darner::queue::options options;
+   options.read_ahead = 4;
+   queue_.reset(); // reopen with a cold cache
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string(), options));
+
+   for (size_t i = 0; i != 10; ++i)
+   {
+      iqs_.open(queue_);
+      iqs_.read(pop_value_);
+      BOOST_REQUIRE_EQUAL(pop_value_, value);
+      iqs_.close(true);
+   }
+
+   ostringstream out;
+   queue_->write_stats("queue", out);
+   BOOST_REQUIRE(out.str().find("STAT queue_queue_cache_hits 8\r\n") != string::npos);
+   BOOST_REQUIRE(out.str().find("STAT queue_queue_cache_misses 2\r\n") != string::npos);
+}
+
+// test items returned out of order come back oldest first
+BOOST_FIXTURE_TEST_CASE( test_returned_order, fixtures::basic_queue )
+{
+   boost::ptr_vector<darner::iqstream> streams;
+   for (size_t i = 0; i != 6; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(lexical_cast<string>(i));
+      streams.push_back(new darner::iqstream());
+      BOOST_REQUIRE(streams.back().open(queue_));
+   }
+
+   size_t order[] = { 3, 1, 5, 0, 2 }; // 4 stays open
+   for (size_t i = 0; i != 5; ++i)
+      streams[order[i]].close(false);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 5);
+
+   for (size_t i = 0; i != 6; ++i)
+   {
+      if (i == 4)
+         continue;
+      BOOST_REQUIRE(iqs_.open(queue_));
+      iqs_.read(pop_value_);
+      BOOST_REQUIRE_EQUAL(pop_value_, lexical_cast<string>(i));
+      iqs_.close(true);
+   }
+   BOOST_REQUIRE(!iqs_.open(queue_));
+}
+
+// test compactions go to the compactor, and the queue waits for them before closing its journal
+BOOST_FIXTURE_TEST_CASE( test_background_compaction, fixtures::basic_queue )
+{
+   string value = "I hate when I'm on a flight and I wake up with a water bottle next to me like oh great now I gotta "
+                  "be responsible for this water bottle";
+   darner::compactor comp;
+   darner::queue::options options;
+   options.compact_bytes = value.size() - 1;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "compacted").string(), options, &comp));
+
+   for (size_t i = 0; i != 2; ++i) // leave one behind, or there's nothing to compact
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+   iqs_.open(queue_);
+   iqs_.read(pop_value_);
+   iqs_.close(true);
+   queue_.reset();
+
+   ostringstream out;
+   comp.write_stats(out);
+   BOOST_REQUIRE(out.str().find("STAT compactions 1\r\n") != string::npos);
+   BOOST_REQUIRE(out.str().find("STAT compactions_in_flight 0\r\n") != string::npos);
+}
+
+// test destroyed journals are deleted by the reaper, including ones left over from before a restart
+BOOST_FIXTURE_TEST_CASE( test_reaper, fixtures::basic_queue )
+{
+   filesystem::create_directory(tmp_ / "data");
+   filesystem::create_directory(tmp_ / "data" / "stale.0");
+   std::ofstream((tmp_ / "data" / "stale.0" / "000001.log").string().c_str());
+   std::ofstream(darner::queue::destroyed_path((tmp_ / "data" / "stale.0").string()).c_str());
+
+   // an older darner didn't mark what it destroyed, so an old format journal next to its queue is taken as destroyed
+   filesystem::create_directory(tmp_ / "data" / "old");
+   filesystem::create_directory(tmp_ / "data" / "old.1");
+   {
+      std::ofstream summary((tmp_ / "data" / "old" / "SUMMARY").string().c_str());
+      summary << "items 0\nbytes 0\npushed 0\n";
+      std::ofstream current((tmp_ / "data" / "old.1" / "CURRENT").string().c_str());
+      current << "MANIFEST-000002\n";
+      std::ofstream manifest((tmp_ / "data" / "old.1" / "MANIFEST-000002").string().c_str());
+      manifest << "queue::comparator";
+   }
+
+   {
+      darner::queue_map queues(ios_, (tmp_ / "data").string());
+      BOOST_REQUIRE(queues.begin() == queues.end()); // stale.0 and old.1 aren't loaded as queues
+      queues["doomed"]->destroy();
+      BOOST_REQUIRE(filesystem::exists(tmp_ / "data" / "doomed.0"));
+      queues.erase("doomed");
+
+      bool reaped = false;
+      for (size_t i = 0; i != 500 && !reaped; ++i)
+      {
+         this_thread::sleep(posix_time::milliseconds(10));
+         ostringstream out;
+         queues.write_stats(out);
+         reaped = out.str().find("STAT journals_reaped 3\r\n") != string::npos;
+      }
+      BOOST_REQUIRE(reaped);
+      BOOST_REQUIRE(!filesystem::exists(tmp_ / "data" / "stale.0"));
+      BOOST_REQUIRE(!filesystem::exists(tmp_ / "data" / "old.1"));
+      BOOST_REQUIRE(!filesystem::exists(tmp_ / "data" / "doomed.0"));
+   }
+}
+
+// test that journals open on first use, and close when there are too many open or they go unused
+BOOST_FIXTURE_TEST_CASE( test_lazy_open, fixtures::basic_queue )
+{
+   string value = "People always say that you can't please everybody. I think that's a cop-out";
+   filesystem::create_directory(tmp_ / "data");
+   {
+      darner::queue_map queues(ios_, (tmp_ / "data").string(), darner::queue::options(),
+         darner::queue_map::options_map(), 1, 0, 0, 0, 1);
+      oqs_.open(queues["first"], 1);
+      oqs_.write(value);
+      oqs_.open(queues["second"], 1); // only room for one
+      oqs_.write(value);
+      oqs_.open(queues["second"], 1);
+      oqs_.write(value);
+
+      ostringstream out;
+      queues.write_stats(out);
+      BOOST_REQUIRE(out.str().find("STAT queues_open 1\r\n") != string::npos);
+      BOOST_REQUIRE(out.str().find("STAT queue_first_items 1\r\n") != string::npos);
+      BOOST_REQUIRE(out.str().find("STAT queue_first_bytes " + lexical_cast<string>(value.size()) + "\r\n") !=
+         string::npos);
+   }
+
+   darner::queue_map queues(ios_, (tmp_ / "data").string(), darner::queue::options(),
+      darner::queue_map::options_map(), 1, 0, 0, 0, 0, 10);
+   ostringstream out;
+   queues.write_stats(out);
+   BOOST_REQUIRE(out.str().find("STAT queues_open 0\r\n") != string::npos); // known by their summaries
+   BOOST_REQUIRE(out.str().find("STAT queue_second_items 2\r\n") != string::npos);
+   BOOST_REQUIRE(out.str().find("STAT queue_second_bytes " + lexical_cast<string>(2 * value.size()) + "\r\n") !=
+      string::npos);
+   BOOST_REQUIRE(out.str().find("STAT queue_second_age_ms ") != string::npos);
+
+   queues.flush("nobody"); // flushing a queue that doesn't exist doesn't create it
+   BOOST_REQUIRE(!filesystem::exists(tmp_ / "data" / "nobody"));
+
+   BOOST_REQUIRE(iqs_.open(queues["first"]));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value);
+   iqs_.close(true);
+
+   bool closed = false;
+   for (size_t i = 0; i != 100 && !closed; ++i)
+   {
+      ios_.run_one(); // the erase's commit, then the idle timer
+      out.str("");
+      queues.write_stats(out);
+      closed = out.str().find("STAT queues_open 0\r\n") != string::npos;
+   }
+   BOOST_REQUIRE(closed);
+   BOOST_REQUIRE(out.str().find("STAT queue_first_items 0\r\n") != string::npos);
+}
+
+// test that queues that didn't close cleanly are recovered in parallel at startup
+BOOST_FIXTURE_TEST_CASE( test_parallel_recovery, fixtures::basic_queue )
+{
+   string value = "I'm a creative genius and there's no other way to word it";
+   filesystem::create_directory(tmp_ / "data");
+   {
+      darner::queue_map queues(ios_, (tmp_ / "data").string());
+      for (size_t i = 0; i != 6; ++i)
+      {
+         oqs_.open(queues["crashed" + lexical_cast<string>(i)], 1);
+         oqs_.write(value);
+      }
+   }
+   for (size_t i = 0; i != 6; ++i) // as if we never got to close them
+      filesystem::remove(tmp_ / "data" / ("crashed" + lexical_cast<string>(i)) / "SUMMARY");
+
+   darner::queue_map queues(ios_, (tmp_ / "data").string(), darner::queue::options(),
+      darner::queue_map::options_map(), 1, 0, 0, 0, 0, 0, 3);
+   ostringstream out;
+   queues.write_stats(out);
+   BOOST_REQUIRE(out.str().find("STAT queues_open 6\r\n") != string::npos);
+   BOOST_REQUIRE(out.str().find("STAT recovery_ms ") != string::npos);
+   for (size_t i = 0; i != 6; ++i)
+   {
+      string name = "crashed" + lexical_cast<string>(i);
+      BOOST_REQUIRE(out.str().find("STAT queue_" + name + "_items 1\r\n") != string::npos);
+      BOOST_REQUIRE(out.str().find("STAT queue_" + name + "_open_ms ") != string::npos);
+   }
+}
+
+// test flush drops queued, returned and open items, but not pushes in progress, and that it lasts across a restart
+BOOST_FIXTURE_TEST_CASE( test_flush, fixtures::basic_queue )
+{
+   string value = "I'm not a fan of books. I would never want a book's autograph";
+   string chunk = "Everything I'm not made me everything I am";
+   for (size_t i = 0; i != 3; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+
+   darner::iqstream returned;
+   BOOST_REQUIRE(iqs_.open(queue_)); // stays open across the flush
+   BOOST_REQUIRE(returned.open(queue_));
+   returned.close(false);
+
+   darner::oqstream pushing;
+   pushing.open(queue_, 2);
+   pushing.write(chunk);
+
+   queue_->flush();
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+
+   pushing.write(chunk);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+   iqs_.close(false); // doesn't come back
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, chunk);
+}
+
+// test that erases stay erased across a restart, whether they move the low-water mark or land above it
+BOOST_FIXTURE_TEST_CASE( test_low_water, fixtures::basic_queue )
+{
+   string value = "If you're a Kanye West fan, you're not a fan of me, you're a fan of yourself";
+   string chunk = "I refuse to accept other people's ideas of happiness for me";
+   oqs_.open(queue_, 2);
+   oqs_.write(chunk);
+   oqs_.write(chunk);
+   for (size_t i = 0; i != 4; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value + lexical_cast<string>(i));
+   }
+
+   for (size_t i = 0; i != 2; ++i) // the multi-chunk item and value0, in order
+   {
+      BOOST_REQUIRE(iqs_.open(queue_));
+      iqs_.close(true);
+   }
+   darner::iqstream first, second;
+   BOOST_REQUIRE(first.open(queue_));
+   BOOST_REQUIRE(second.open(queue_));
+   second.close(true); // value2 lands above the mark
+   first.close(true); // and value1 brings the mark up past it
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.close(false);
+   ios_.run(); // commit the erases
+
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value + "3");
+   iqs_.close(true);
+   ios_.reset();
+   ios_.run();
+
+   // and a multi-chunk push after the restart doesn't reuse erased chunks
+   oqs_.open(queue_, 2);
+   oqs_.write(chunk);
+   oqs_.write(value);
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, chunk);
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value);
+}
+
+namespace {
+
+size_t blob_files(const filesystem::path& path)
+{
+   size_t files = 0;
+   filesystem::directory_iterator end_it;
+   for (filesystem::directory_iterator it(path); it != end_it; ++it)
+      files += it->path().extension() == ".blob";
+   return files;
+}
+
+} // anonymous
+
+// test that large items go to blob files, survive a restart, and free their files once they're popped
+BOOST_FIXTURE_TEST_CASE( test_blob_store, fixtures::basic_queue )
+{
+   string chunk = "Sometimes you have to be your own hero";
+   darner::queue::options options;
+   options.blob_threshold = chunk.size();
+   options.blob_file_size = 3 * chunk.size();
+   filesystem::path path = tmp_ / "blobs";
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+
+   for (size_t i = 0; i != 4; ++i) // two items per file
+   {
+      oqs_.open(queue_, 2, false, 2 * chunk.size() + 1);
+      oqs_.write(chunk);
+      oqs_.write(chunk + lexical_cast<string>(i));
+   }
+   oqs_.open(queue_, 1, false, chunk.size()); // small enough for the journal
+   oqs_.write(chunk);
+   BOOST_REQUIRE_EQUAL(blob_files(path), 2);
+
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 5);
+   for (size_t i = 0; i != 2; ++i)
+   {
+      int fd;
+      darner::queue::size_type offset;
+      BOOST_REQUIRE(iqs_.open(queue_));
+      iqs_.read(pop_value_);
+      string value = pop_value_;
+      BOOST_REQUIRE(iqs_.blob(fd, offset));
+      iqs_.read(pop_value_);
+      BOOST_REQUIRE_EQUAL(value + pop_value_, chunk + chunk + lexical_cast<string>(i));
+      BOOST_REQUIRE_EQUAL(iqs_.tell(), iqs_.size());
+      iqs_.close(true);
+   }
+   ios_.run(); // commit the erases, which frees the first file
+   BOOST_REQUIRE_EQUAL(blob_files(path), 1);
+
+   // the rest can be sent straight from the file
+   int fd;
+   darner::queue::size_type offset;
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE(iqs_.blob(fd, offset));
+   string rest(iqs_.size() - iqs_.tell(), '\0');
+   BOOST_REQUIRE_EQUAL(::pread(fd, &rest[0], rest.size(), offset), static_cast<ssize_t>(rest.size()));
+   BOOST_REQUIRE_EQUAL(pop_value_ + rest, chunk + chunk + "2");
+   iqs_.skip(rest.size());
+   BOOST_REQUIRE_EQUAL(iqs_.tell(), iqs_.size());
+   iqs_.close(true);
+
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   iqs_.close(true);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, chunk);
+   BOOST_REQUIRE(!iqs_.blob(fd, offset));
+}
+
+// test that bigger items are streamed in bigger chunks, up to max_chunk_size
+BOOST_FIXTURE_TEST_CASE( test_chunk_size, fixtures::basic_queue )
+{
+   darner::queue::options options;
+   options.chunk_size = 1024;
+   options.max_chunk_size = 65536;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "chunks").string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->chunk_size(100), 1024);
+   BOOST_REQUIRE_EQUAL(queue_->chunk_size(16 * 1024), 1024);
+   BOOST_REQUIRE_EQUAL(queue_->chunk_size(100 * 1024), 8192);
+   BOOST_REQUIRE_EQUAL(queue_->chunk_size(100 * 1024 * 1024), 65536);
+
+   options.max_chunk_size = 0;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "fixed").string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->chunk_size(100 * 1024 * 1024), 1024);
+}
+
+// test that we can tell how much of a queue's files are in the page cache
+BOOST_FIXTURE_TEST_CASE( test_page_cache_bytes, fixtures::basic_queue )
+{
+   darner::queue::options options;
+   BOOST_REQUIRE(options.set("drop_behind", "on"));
+   BOOST_REQUIRE(!options.set("drop_behind", "sometimes"));
+   filesystem::path path = tmp_ / "cached";
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+
+   {
+      std::ofstream out((path / "written").string().c_str());
+      out << string(3 * ::sysconf(_SC_PAGESIZE), 'x'); // just written, so it's all in the page cache
+   }
+   BOOST_REQUIRE_GE(darner::page_cache_env::resident_bytes(path.string()), 3 * ::sysconf(_SC_PAGESIZE));
+
+   ostringstream stats;
+   queue_->write_stats("cached", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_cached_page_cache_bytes ") != string::npos);
+
+   // with a reaper, it's counted in the background, and kept up to date
+   darner::reaper reap(0, 10);
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string(), options, NULL, &reap));
+   stats.str("");
+   queue_->write_stats("cached", stats);
+   for (size_t i = 0; i != 100 && stats.str().find("STAT queue_cached_page_cache_bytes 0\r\n") != string::npos; ++i)
+   {
+      this_thread::sleep(posix_time::milliseconds(10));
+      stats.str("");
+      queue_->write_stats("cached", stats);
+   }
+   BOOST_REQUIRE(stats.str().find("STAT queue_cached_page_cache_bytes 0\r\n") == string::npos);
+   queue_.reset();
+
+   queue_.reset(new darner::queue(ios_, (tmp_ / "uncached").string()));
+   stats.str("");
+   queue_->write_stats("uncached", stats);
+   BOOST_REQUIRE(stats.str().find("_page_cache_bytes ") == string::npos); // only counted with drop_behind
+}
+
+// test that drop_behind leaves a queue's live tables in the page cache, popped or not, until they're compacted away
+BOOST_FIXTURE_TEST_CASE( test_drop_behind_keeps_tail, fixtures::basic_queue )
+{
+   darner::queue::options options;
+   options.drop_behind = true;
+   options.compression = false;
+   options.cache_size = 0; // so pops read the journal
+   filesystem::path path = tmp_ / "tail";
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   string value(1024, 'x');
+   for (size_t i = 0; i != 256; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+
+   // reopening writes the log out to a table, which we then read half of
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   for (size_t i = 0; i != 128; ++i)
+   {
+      BOOST_REQUIRE(iqs_.open(queue_));
+      iqs_.read(pop_value_);
+      iqs_.close(true);
+   }
+
+   boost::uintmax_t tables = 0;
+   filesystem::directory_iterator end_it;
+   for (filesystem::directory_iterator it(path); it != end_it; ++it)
+   {
+      if (it->path().extension() == ".sst" || it->path().extension() == ".ldb")
+         tables += filesystem::file_size(it->path());
+   }
+   BOOST_REQUIRE_GT(tables, 128 * value.size());
+   BOOST_REQUIRE_GE(darner::page_cache_env::resident_bytes(path.string()), tables);
+}
+
+// test that a reopened queue reads its tail into the cache, inline or on a warmer
+BOOST_FIXTURE_TEST_CASE( test_warm_up, fixtures::basic_queue )
+{
+   string value = "I still think I am the greatest";
+   oqs_.open(queue_, 2);
+   oqs_.write(value);
+   oqs_.write(value);
+   for (size_t i = 0; i != 8; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value);
+   }
+
+   darner::queue::options options;
+   options.warm_bytes = 4 * value.size(); // the multi-chunk item and a couple more
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string(), options));
+   ostringstream stats;
+   queue_->write_stats("warm", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_warm_warming 0\r\n") != string::npos);
+   BOOST_REQUIRE(stats.str().find("STAT queue_warm_warm_bytes 0\r\n") == string::npos);
+
+   darner::warmer warm;
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string(), options, NULL, NULL, &warm));
+   for (size_t i = 0; i != 100 && stats.str().find("STAT warmups 1\r\n") == string::npos; ++i)
+   {
+      this_thread::sleep(posix_time::milliseconds(10));
+      stats.str("");
+      warm.write_stats(stats);
+   }
+   BOOST_REQUIRE(stats.str().find("STAT warmups 1\r\n") != string::npos);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 9);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value);
+   iqs_.close(false);
+
+   // with drop_behind, the tables a warm-up reads stay in the page cache too
+   options.drop_behind = true;
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string(), options));
+   boost::uintmax_t tables = 0;
+   filesystem::directory_iterator end_it;
+   for (filesystem::directory_iterator it(tmp_ / "queue"); it != end_it; ++it)
+   {
+      if (it->path().extension() == ".sst" || it->path().extension() == ".ldb")
+         tables += filesystem::file_size(it->path());
+   }
+   BOOST_REQUIRE(tables > 0);
+   BOOST_REQUIRE_GE(darner::page_cache_env::resident_bytes((tmp_ / "queue").string()), tables);
+
+   // a queue can go while it's still warming up
+   options.warm_bytes = 1 << 30;
+   darner::warmer slow(1);
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "queue").string(), options, NULL, NULL, &slow));
+   queue_.reset();
+}
+
+// test that a memory queue keeps nothing on disk, and drops or spills once it's full
+BOOST_FIXTURE_TEST_CASE( test_memory_journal, fixtures::basic_queue )
+{
+   string value = "I am Warhol. I am the No. 1 most impactful artist of our generation";
+   darner::queue::options options;
+   BOOST_REQUIRE(options.set("journal", "memory"));
+   BOOST_REQUIRE(options.set("memory_limit", lexical_cast<string>(10 * value.size())));
+   BOOST_REQUIRE(options.set("memory_full", "drop"));
+   BOOST_REQUIRE(!options.set("memory_full", "sometimes"));
+   filesystem::path path = tmp_ / "memory";
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+
+   for (size_t i = 0; i != 12; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value, push_cb_);
+      ios_.reset();
+      ios_.run(); // the cap counts what's committed
+   }
+   BOOST_REQUIRE_EQUAL(push_count_, 12); // dropped pushes are answered too, with an error
+   BOOST_REQUIRE(error_ == asio::error::no_buffer_space);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 8); // a key's bytes and its stamp count too
+   BOOST_REQUIRE(!filesystem::exists(path / "CURRENT"));
+   ostringstream stats;
+   queue_->write_stats("memory", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_memory_dropped 4\r\n") != string::npos);
+
+   // two-phase pops work just the same
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value);
+   iqs_.close(false);
+   BOOST_REQUIRE(queue_->idle() == false); // closing it would lose its items
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.close(true);
+   ios_.reset();
+   ios_.run();
+   BOOST_REQUIRE_EQUAL(queue_->count(), 7);
+
+   // nothing survives a restart
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+
+   // spilled items all come back, in order, and the queue goes back to memory once it's drained
+   BOOST_REQUIRE(options.set("memory_full", "spill"));
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   for (size_t i = 0; i != 20; ++i)
+   {
+      oqs_.open(queue_, 2);
+      oqs_.write(lexical_cast<string>(i));
+      oqs_.write(value);
+   }
+   stats.str("");
+   queue_->write_stats("memory", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_memory_spilled 1\r\n") != string::npos);
+   for (size_t i = 0; i != 20; ++i)
+   {
+      BOOST_REQUIRE(iqs_.open(queue_));
+      string item;
+      do
+      {
+         iqs_.read(pop_value_);
+         item += pop_value_;
+      } while (iqs_.tell() != iqs_.size());
+      BOOST_REQUIRE_EQUAL(item, lexical_cast<string>(i) + value);
+      iqs_.close(true);
+      ios_.reset();
+      ios_.run(); // unspilled at the commit that drains it
+   }
+   stats.str("");
+   queue_->write_stats("memory", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_memory_spilled 0\r\n") != string::npos);
+   BOOST_REQUIRE(!filesystem::exists(path / "spill"));
+
+   // a name pattern puts a whole family of queues in memory
+   filesystem::create_directory(tmp_ / "data");
+   darner::queue_map::options_map overrides;
+   overrides["tele*"] = options;
+   darner::queue_map queues(ios_, (tmp_ / "data").string(), darner::queue::options(), overrides);
+   oqs_.open(queues["telemetry"], 1);
+   oqs_.write(value);
+   oqs_.open(queues["durable"], 1);
+   oqs_.write(value);
+   BOOST_REQUIRE(!filesystem::exists(tmp_ / "data" / "telemetry" / "CURRENT"));
+   BOOST_REQUIRE(filesystem::exists(tmp_ / "data" / "durable" / "CURRENT"));
+}
+
+// test that items are stamped with when they were pushed, for the age stat and the time in queue histogram
+BOOST_FIXTURE_TEST_CASE( test_age, fixtures::basic_queue )
+{
+   string value = string("Nothing in life is promised except death") + '\3' + '\0'; // looks like a stamp
+   ostringstream stats;
+   queue_->write_stats("aging", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_aging_age_ms 0\r\n") != string::npos);
+
+   oqs_.open(queue_, 1);
+   oqs_.write(value);
+   oqs_.open(queue_, 2);
+   oqs_.write(value);
+   oqs_.write(value);
+   this_thread::sleep(posix_time::milliseconds(50));
+
+   stats.str("");
+   queue_->write_stats("aging", stats);
+   size_t pos = stats.str().find("STAT queue_aging_age_ms ") + strlen("STAT queue_aging_age_ms ");
+   BOOST_REQUIRE_GE(lexical_cast<size_t>(stats.str().substr(pos, stats.str().find('\r', pos) - pos)), 50);
+
+   for (size_t i = 0; i != 2; ++i)
+   {
+      BOOST_REQUIRE(iqs_.open(queue_));
+      string item;
+      do
+      {
+         iqs_.read(pop_value_);
+         item += pop_value_;
+      } while (iqs_.tell() != iqs_.size());
+      BOOST_REQUIRE_EQUAL(item, i ? value + value : value);
+      iqs_.close(true);
+   }
+
+   stats.str("");
+   queue_->write_stats("aging", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_aging_age_ms 0\r\n") != string::npos);
+   BOOST_REQUIRE(stats.str().find("STAT queue_aging_time_in_queue_count 2\r\n") != string::npos);
+   BOOST_REQUIRE(stats.str().find("STAT queue_aging_time_in_queue_p50_ms 63\r\n") != string::npos ||
+      stats.str().find("STAT queue_aging_time_in_queue_p50_ms 127\r\n") != string::npos);
+
+   // an item still waiting for its group to be written has an age too, even when it's not in the cache
+   darner::queue::options options;
+   options.cache_size = 0;
+   queue_.reset(new darner::queue(ios_, (tmp_ / "grouped").string(), options));
+   oqs_.open(queue_, 1);
+   oqs_.write(value, push_cb_); // written on the next turn of the loop
+   this_thread::sleep(posix_time::milliseconds(20));
+   stats.str("");
+   queue_->write_stats("grouped", stats);
+   pos = stats.str().find("STAT queue_grouped_age_ms ") + strlen("STAT queue_grouped_age_ms ");
+   BOOST_REQUIRE_GE(lexical_cast<size_t>(stats.str().substr(pos, stats.str().find('\r', pos) - pos)), 20);
+   ios_.reset();
+   ios_.run();
+   BOOST_REQUIRE_EQUAL(push_count_, 1);
+
+   darner::histogram h;
+   BOOST_REQUIRE_EQUAL(h.percentile(0.5), 0);
+   for (size_t i = 0; i != 100; ++i)
+      h.record(i);
+   BOOST_REQUIRE_EQUAL(h.percentile(0.5), 63);
+   BOOST_REQUIRE_EQUAL(h.percentile(0.99), 127);
+}
+
+// test that expired items are skipped at pop time and swept from the expiry index, and can go to another queue
+BOOST_FIXTURE_TEST_CASE( test_expiry, fixtures::basic_queue )
+{
+   string value = "I'd like to take a moment to thank everyone who made it possible";
+   darner::queue::size_type past = 2592001; // a unix time, a month into 1970
+   darner::queue::options options;
+   BOOST_REQUIRE(options.set("expire_to", "stale"));
+   BOOST_REQUIRE(options.set("sweep_ms", "10"));
+   BOOST_REQUIRE(!options.set("sweep_ms", "0"));
+   filesystem::create_directory(tmp_ / "data");
+   darner::queue_map::options_map overrides;
+   overrides["fleeting"] = options;
+   darner::queue_map queues(ios_, (tmp_ / "data").string(), darner::queue::options(), overrides);
+   shared_ptr<darner::queue> fleeting = queues["fleeting"];
+
+   oqs_.open(fleeting, 1, false, value.size(), past);
+   oqs_.write(value);
+   oqs_.open(fleeting, 2, false, 2 * value.size(), past);
+   oqs_.write(value);
+   oqs_.write(value);
+   oqs_.open(fleeting, 1, false, value.size(), 60);
+   oqs_.write(value + "!");
+   BOOST_REQUIRE_EQUAL(fleeting->count(), 3);
+
+   // the pop steps past both expired items to the one that isn't
+   BOOST_REQUIRE(iqs_.open(fleeting));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value + "!");
+   iqs_.close(true);
+   ostringstream stats;
+   fleeting->write_stats("fleeting", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_fleeting_expired 2\r\n") != string::npos);
+
+   // and they're moved whole
+   shared_ptr<darner::queue> stale = queues["stale"];
+   BOOST_REQUIRE_EQUAL(stale->count(), 2);
+   BOOST_REQUIRE(iqs_.open(stale));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value);
+   iqs_.close(true);
+   BOOST_REQUIRE(iqs_.open(stale));
+   string item;
+   do
+   {
+      iqs_.read(pop_value_);
+      item += pop_value_;
+   } while (iqs_.tell() != iqs_.size());
+   BOOST_REQUIRE_EQUAL(item, value + value);
+   iqs_.close(true);
+   fleeting.reset();
+   stale.reset();
+
+   // with a max age, items nobody pops are swept out, and stay gone after a restart.  the sweep only reads what's due,
+   // and stops once the index is empty
+   options = darner::queue::options();
+   BOOST_REQUIRE(options.set("max_age_ms", "20"));
+   BOOST_REQUIRE(options.set("sweep_ms", "10"));
+   queue_.reset(new darner::queue(ios_, (tmp_ / "aging").string(), options));
+   for (size_t i = 0; i != 3; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value, push_cb_);
+   }
+   oqs_.open(queue_, 2);
+   oqs_.write(value);
+   oqs_.write(value);
+   ios_.reset();
+   ios_.run();
+   BOOST_REQUIRE_EQUAL(push_count_, 3);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+   BOOST_REQUIRE(!iqs_.open(queue_));
+   stats.str("");
+   queue_->write_stats("aging", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_aging_expired 4\r\n") != string::npos);
+   BOOST_REQUIRE(stats.str().find("STAT queue_aging_time_in_queue_count 0\r\n") != string::npos);
+
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, (tmp_ / "aging").string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 0);
+   oqs_.open(queue_, 1);
+   oqs_.write(value);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value);
+}
+
+// test that a queue counts its bytes across restarts, and holds to max_items and max_bytes
+BOOST_FIXTURE_TEST_CASE( test_limits, fixtures::basic_queue )
+{
+   string value = "I think that's a responsibility that I have, to push possibilities, to show people";
+   darner::queue::options options;
+   BOOST_REQUIRE(options.set("max_items", "3"));
+   BOOST_REQUIRE(!options.set("when_full", "sometimes"));
+   filesystem::path path = tmp_ / "limited";
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+
+   // past the limit, sets are rejected
+   for (size_t i = 0; i != 4; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(value, push_cb_);
+   }
+   ios_.reset();
+   ios_.run();
+   BOOST_REQUIRE_EQUAL(push_count_, 4);
+   BOOST_REQUIRE(error_ == asio::error::no_buffer_space);
+   oqs_.open(queue_, 2);
+   oqs_.write(value);
+   BOOST_REQUIRE_THROW(oqs_.write(value), system::system_error);
+   BOOST_REQUIRE_EQUAL(queue_->count(), 3);
+   BOOST_REQUIRE_EQUAL(queue_->bytes(), 3 * value.size());
+   ostringstream stats;
+   queue_->write_stats("limited", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_limited_rejected 2\r\n") != string::npos);
+   BOOST_REQUIRE(stats.str().find("STAT queue_limited_bytes " + lexical_cast<string>(3 * value.size()) + "\r\n") !=
+      string::npos);
+
+   // the byte count survives a restart, and follows pops and flushes
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.close(true);
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->bytes(), 2 * value.size());
+   BOOST_REQUIRE(iqs_.open(queue_));
+   queue_->flush();
+   BOOST_REQUIRE_EQUAL(queue_->bytes(), value.size()); // until it's closed
+   iqs_.close(false);
+   BOOST_REQUIRE_EQUAL(queue_->bytes(), 0);
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string(), options));
+   BOOST_REQUIRE_EQUAL(queue_->bytes(), 0);
+
+   // or the oldest items make way for new ones
+   options = darner::queue::options();
+   BOOST_REQUIRE(options.set("max_bytes", lexical_cast<string>(2 * value.size() + 20)));
+   BOOST_REQUIRE(options.set("when_full", "discard_old"));
+   queue_.reset(new darner::queue(ios_, (tmp_ / "discarding").string(), options));
+   for (size_t i = 0; i != 5; ++i)
+   {
+      oqs_.open(queue_, 1);
+      oqs_.write(lexical_cast<string>(i) + value);
+   }
+   BOOST_REQUIRE_EQUAL(queue_->count(), 2);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, "3" + value);
+   stats.str("");
+   queue_->write_stats("discarding", stats);
+   BOOST_REQUIRE(stats.str().find("STAT queue_discarding_discarded 3\r\n") != string::npos);
+}
+
+namespace {
+
+// orders keys like journals did before the bytewise format: a native-endian id, then the type
+class legacy_comparator : public leveldb::Comparator
+{
+public:
+   int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
+   {
+      if (a[8] != b[8])
+         return a[8] < b[8] ? -1 : 1;
+      uint64_t ida = *reinterpret_cast<const uint64_t*>(a.data()), idb = *reinterpret_cast<const uint64_t*>(b.data());
+      return ida < idb ? -1 : ida > idb ? 1 : 0;
+   }
+   const char* Name() const { return "queue::comparator"; }
+   void FindShortestSeparator(std::string*, const leveldb::Slice&) const {}
+   void FindShortSuccessor(std::string*) const {}
+};
+
+string legacy_key(char type, uint64_t id)
+{
+   return string(reinterpret_cast<const char*>(&id), sizeof(id)) + type;
+}
+
+} // anonymous
+
+// test that a journal in the old key format is migrated when it's opened
+BOOST_FIXTURE_TEST_CASE( test_migrate_journal, fixtures::basic_queue )
+{
+   string value1 = "I feel like I'm too busy writing history to read it";
+   string value2 = "My greatest pain in life is that I will never be able to see myself perform live";
+   filesystem::path path = tmp_ / "legacy";
+   {
+      legacy_comparator cmp;
+      leveldb::Options options;
+      options.create_if_missing = true;
+      options.comparator = &cmp;
+      leveldb::DB* pdb;
+      BOOST_REQUIRE(leveldb::DB::Open(options, path.string(), &pdb).ok());
+      scoped_ptr<leveldb::DB> journal(pdb);
+      uint64_t low_water = 256; // ids past a byte, so little-endian order would be wrong
+      journal->Put(leveldb::WriteOptions(), legacy_key(0, 0), string(reinterpret_cast<const char*>(&low_water), 8));
+      journal->Put(leveldb::WriteOptions(), legacy_key(1, 255), "flushed");
+      journal->Put(leveldb::WriteOptions(), legacy_key(1, 256), value1);
+      journal->Put(leveldb::WriteOptions(), legacy_key(1, 257), value2);
+   }
+   filesystem::create_directory(path.string() + ".migrating"); // left over from a migration that didn't finish
+
+   queue_.reset(new darner::queue(ios_, path.string()));
+   BOOST_REQUIRE(!filesystem::exists(path.string() + ".migrating"));
+   BOOST_REQUIRE(!filesystem::exists(path.string() + ".unmigrated"));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 2);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value1);
+   iqs_.close(true);
+
+   // and it stays migrated
+   queue_.reset();
+   queue_.reset(new darner::queue(ios_, path.string()));
+   BOOST_REQUIRE_EQUAL(queue_->count(), 1);
+   BOOST_REQUIRE(iqs_.open(queue_));
+   iqs_.read(pop_value_);
+   BOOST_REQUIRE_EQUAL(pop_value_, value2);
+}
+
+namespace {
+
+struct compaction_log
+{
+   compaction_log() : started(false), blocked(true) {}
+
+   darner::compactor::result_type block()
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      started = true;
+      changed.notify_all();
+      while (blocked)
+         changed.wait(lock);
+      return darner::compactor::result_type();
+   }
+
+   darner::compactor::result_type job(int id)
+   {
+      boost::mutex::scoped_lock lock(mutex);
+      order.push_back(id);
+      return darner::compactor::result_type(id, id);
+   }
+
+   void done() {}
+
+   bool started;
+   bool blocked;
+   std::vector<int> order;
+   boost::mutex mutex;
+   boost::condition_variable changed;
+};
+
+} // anonymous
+
+// test pending compactions run most debt first, and can be canceled before they start
+BOOST_AUTO_TEST_CASE( test_compactor_priority )
+{
+   compaction_log log;
+   {
+      darner::compactor comp;
+      darner::compactor::done_type done = bind(&compaction_log::done, &log);
+      comp.post(0, bind(&compaction_log::block, &log), done); // holds up the only worker
+      {
+         boost::mutex::scoped_lock lock(log.mutex);
+         while (!log.started)
+            log.changed.wait(lock);
+      }
+      comp.post(10, bind(&compaction_log::job, &log, 10), done);
+      darner::compactor::ticket_type canceled = comp.post(40, bind(&compaction_log::job, &log, 40), done);
+      comp.post(30, bind(&compaction_log::job, &log, 30), done);
+      comp.post(20, bind(&compaction_log::job, &log, 20), done);
+      BOOST_REQUIRE(comp.cancel(canceled));
+
+      ostringstream out;
+      comp.write_stats(out);
+      BOOST_REQUIRE(out.str().find("STAT compaction_debt_pending 60\r\n") != string::npos);
+
+      {
+         boost::mutex::scoped_lock lock(log.mutex);
+         log.blocked = false;
+      }
+      log.changed.notify_all();
+   } // the compactor finishes everything before it goes
+
+   BOOST_REQUIRE_EQUAL(log.order.size(), 3);
+   BOOST_REQUIRE_EQUAL(log.order[0], 30);
+   BOOST_REQUIRE_EQUAL(log.order[1], 20);
+   BOOST_REQUIRE_EQUAL(log.order[2], 10);
+}
+
+// test the rate charges each compaction for what it read and wrote, not for its debt
+BOOST_AUTO_TEST_CASE( test_compactor_rate )
+{
+   compaction_log log;
+   darner::compactor comp(1, 1000);
+   darner::compactor::done_type done = bind(&compaction_log::done, &log);
+   posix_time::ptime start = posix_time::microsec_clock::universal_time();
+   comp.post(1, bind(&compaction_log::job, &log, 100), done); // a little debt, but a tenth of a second of io
+   comp.post(1, bind(&compaction_log::job, &log, 1), done);
+
+   size_t ran = 0;
+   for (size_t i = 0; i != 500 && ran != 2; ++i) // a compactor that's going away doesn't wait, so we wait here
+   {
+      this_thread::sleep(posix_time::milliseconds(1));
+      boost::mutex::scoped_lock lock(log.mutex);
+      ran = log.order.size();
+   }
+   BOOST_REQUIRE_EQUAL(ran, 2);
+   BOOST_REQUIRE_GE((posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 100);
+
+   ostringstream out;
+   comp.write_stats(out);
+   BOOST_REQUIRE(out.str().find("STAT compaction_bytes_io 101\r\n") != string::npos);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -45,6 +45,15 @@ BOOST_FIXTURE_TEST_CASE( test_set_sync, fixtures::basic_request )
    BOOST_REQUIRE_EQUAL(request_.set_sync, true);
 }
 
+// test that we get a set's expiration
+BOOST_FIXTURE_TEST_CASE( test_set_expiration, fixtures::basic_request )
+{
+   BOOST_REQUIRE(parser_.parse(request_, string("set foo+meow 0 60 31337\r\n")));
+   BOOST_REQUIRE_EQUAL(request_.type, darner::request::RT_SET);
+   BOOST_REQUIRE_EQUAL(request_.set_expiration, 60);
+   BOOST_REQUIRE_EQUAL(request_.num_bytes, 31337);
+}
+
 // test that we get some options correctly for a get
 BOOST_FIXTURE_TEST_CASE( test_get, fixtures::basic_request )
 {